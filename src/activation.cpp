@@ -0,0 +1,159 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+#include "activation.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <set>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+extern char **environ;
+
+namespace io {
+
+    static std::mutex handed_lock;
+    static std::set<std::pair<dev_t, ino_t>> handed; // Identity of sockets (and their files) passed to successors
+
+    static bool socket_identity(int fd, std::pair<dev_t, ino_t> &identity) {
+        struct stat info;
+        if (fstat(fd, &info) != 0) return false;
+        identity = std::make_pair(info.st_dev, info.st_ino);
+        return true;
+    }
+
+    /**
+     * Identity of file UNIX socket `fd` is bound to. Stays known after socket is closed
+     */
+    static bool socket_file_identity(int fd, std::pair<dev_t, ino_t> &identity) {
+        sockaddr_un address;
+        socklen_t length = sizeof(address);
+        memset(&address, 0, sizeof(address));
+        if (getsockname(fd, reinterpret_cast<sockaddr *>(&address), &length) != 0 ||
+            address.sun_family != AF_UNIX || address.sun_path[0] == 0) return false;
+        std::string path(address.sun_path, strnlen(address.sun_path, sizeof(address.sun_path)));
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0) return false;
+        identity = std::make_pair(info.st_dev, info.st_ino);
+        return true;
+    }
+
+    std::vector<InheritedListener> inherited_listeners(bool unset_environment) {
+        std::vector<InheritedListener> listeners;
+        const char *pid = getenv("LISTEN_PID");
+        const char *fds = getenv("LISTEN_FDS");
+        const char *names = getenv("LISTEN_FDNAMES");
+        if (pid != nullptr && fds != nullptr && strtol(pid, nullptr, 10) == getpid()) {
+            long count = strtol(fds, nullptr, 10);
+            std::vector<std::string> labels;
+            if (names != nullptr) {
+                std::string label;
+                for (const char *ptr = names;; ++ptr) {
+                    if (*ptr == ':' || *ptr == 0) {
+                        labels.push_back(label);
+                        label.clear();
+                        if (*ptr == 0) break;
+                    } else label += *ptr;
+                }
+            }
+            for (long i = 0; i < count; ++i) {
+                InheritedListener listener;
+                listener.fd = ListenFdsStart + static_cast<int>(i);
+                if (static_cast<size_t>(i) < labels.size()) listener.name = labels[i];
+                int flags = fcntl(listener.fd, F_GETFD);
+                if (flags < 0) continue; // Not really passed
+                fcntl(listener.fd, F_SETFD, flags | FD_CLOEXEC);
+                listeners.push_back(listener);
+            }
+        }
+        if (unset_environment) {
+            unsetenv("LISTEN_PID");
+            unsetenv("LISTEN_FDS");
+            unsetenv("LISTEN_FDNAMES");
+        }
+        return listeners;
+    }
+
+    int find_listener(const std::vector<InheritedListener> &listeners, const std::string &name) {
+        for (auto &listener:listeners) if (listener.name == name) return listener.fd;
+        return -1;
+    }
+
+    pid_t spawn_with_listeners(const std::string &path, char *const argv[],
+                               const std::vector<InheritedListener> &listeners) {
+        // Everything is prepared before fork: only async-signal-safe calls are allowed in child
+        std::vector<std::string> variables;
+        for (char **item = environ; item != nullptr && *item != nullptr; ++item) {
+            if (strncmp(*item, "LISTEN_", 7) != 0) variables.push_back(*item);
+        }
+        std::string names = "LISTEN_FDNAMES=";
+        for (size_t i = 0; i < listeners.size(); ++i) names += (i > 0 ? ":" : "") + listeners[i].name;
+        variables.push_back("LISTEN_FDS=" + std::to_string(listeners.size()));
+        variables.push_back(names);
+        variables.push_back("LISTEN_PID=00000000000000000000"); // Filled in child
+        std::vector<char *> environment;
+        for (auto &variable:variables) environment.push_back(&variable[0]);
+        environment.push_back(nullptr);
+        char *pid_value = environment[environment.size() - 2] + strlen("LISTEN_PID=");
+        int count = static_cast<int>(listeners.size());
+        std::vector<int> sources;
+        for (auto &listener:listeners) sources.push_back(listener.fd);
+        rlimit limit;
+        int max_fd = getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY
+                     ? static_cast<int>(std::min<rlim_t>(limit.rlim_cur, 1 << 20)) : 1 << 16;
+
+        pid_t pid = fork();
+        if (pid > 0) {
+            std::lock_guard<std::mutex> guard(handed_lock);
+            std::pair<dev_t, ino_t> identity;
+            for (auto &listener:listeners) {
+                if (socket_identity(listener.fd, identity)) handed.insert(identity);
+                if (socket_file_identity(listener.fd, identity)) handed.insert(identity);
+            }
+        }
+        if (pid != 0) return pid;
+        // Child: move sockets out of target range first, then to 3, 4, ...
+        int high = ListenFdsStart + count;
+        for (int i = 0; i < count; ++i) {
+            int moved = fcntl(sources[i], F_DUPFD, high);
+            if (moved < 0) _exit(127);
+            sources[i] = moved;
+        }
+        for (int i = 0; i < count; ++i) {
+            if (dup2(sources[i], ListenFdsStart + i) < 0) _exit(127);
+            close(sources[i]); // dup2 result has no FD_CLOEXEC
+        }
+        // Descriptors opened without O_CLOEXEC (clients, files) must not leak into successor
+#ifdef SYS_close_range
+        if (syscall(SYS_close_range, high, ~0U, 0) != 0)
+#endif
+            for (int fd = high; fd < max_fd; ++fd) close(fd);
+        char digits[24];
+        int length = 0;
+        for (pid_t value = getpid(); value > 0; value /= 10) digits[length++] = static_cast<char>('0' + value % 10);
+        for (int i = 0; i < length; ++i) pid_value[i] = digits[length - 1 - i];
+        pid_value[length] = 0;
+        execve(path.c_str(), argv, environment.data());
+        _exit(127);
+    }
+
+    bool handed_over(int fd) {
+        std::pair<dev_t, ino_t> identity;
+        if (!socket_identity(fd, identity)) return false;
+        std::lock_guard<std::mutex> guard(handed_lock);
+        return handed.count(identity) > 0;
+    }
+
+    bool handed_over(dev_t device, ino_t inode) {
+        std::lock_guard<std::mutex> guard(handed_lock);
+        return handed.count(std::make_pair(device, inode)) > 0;
+    }
+}
@@ -0,0 +1,58 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+#ifndef IO_ACTIVATION_H
+#define IO_ACTIVATION_H
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+namespace io {
+
+    /**
+     * Listening socket passed from parent process
+     */
+    struct InheritedListener {
+        int fd;
+        std::string name; // From LISTEN_FDNAMES or empty
+    };
+
+    enum : int {
+        ListenFdsStart = 3 // First passed descriptor (SD_LISTEN_FDS_START)
+    };
+
+    /**
+     * Sockets passed by systemd socket activation or by spawn_with_listeners (LISTEN_PID, LISTEN_FDS,
+     * LISTEN_FDNAMES). Returned descriptors get FD_CLOEXEC. Variables are removed if `unset_environment`
+     * so child processes don't see them. Use TcpServerManager::adopt/UnixServerManager::adopt to serve them
+     */
+    std::vector<InheritedListener> inherited_listeners(bool unset_environment = true);
+
+    /**
+     * Find inherited listener by name or return -1
+     */
+    int find_listener(const std::vector<InheritedListener> &listeners, const std::string &name);
+
+    /**
+     * Start new binary `path` with `argv` (null terminated, as for execv) and pass listening sockets to it
+     * with LISTEN_FDS protocol. Current process keeps its copies and continues serving until new one
+     * is ready, so accept backlog is never dropped. Other descriptors are closed in successor, even
+     * without FD_CLOEXEC. Returns process id of successor or -1
+     */
+    pid_t spawn_with_listeners(const std::string &path, char *const argv[], const std::vector<InheritedListener> &listeners);
+
+    /**
+     * Whether socket `fd` was passed to a successor by spawn_with_listeners. ~UnixServerManager keeps
+     * socket file of such listeners
+     */
+    bool handed_over(int fd);
+
+    /**
+     * Whether socket file with `device` and `inode` was bound by UNIX listener passed to a successor.
+     * Unlike handed_over(int) it works after listener is closed
+     */
+    bool handed_over(dev_t device, ino_t inode);
+}
+#endif //IO_ACTIVATION_H
@@ -0,0 +1,139 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+#include "affinity.h"
+#include <dirent.h>
+#include <fstream>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace io {
+    namespace {
+        // From <linux/mempolicy.h>
+        const int PolicyPreferred = 1;
+        const int PolicyBind = 2;
+        const size_t MaxNodes = 1024;
+
+        bool fill_cpu_set(const std::vector<int> &cpus, cpu_set_t &set) {
+            CPU_ZERO(&set);
+            for (int cpu:cpus) {
+                if (cpu < 0 || cpu >= CPU_SETSIZE) return false;
+                CPU_SET(cpu, &set);
+            }
+            return !cpus.empty();
+        }
+
+        /**
+         * Parse kernel list format: "0-3,8,10-11"
+         */
+        std::vector<int> parse_list(const std::string &list) {
+            std::vector<int> result;
+            size_t pos = 0;
+            while (pos < list.size()) {
+                size_t end = list.find(',', pos);
+                if (end == std::string::npos) end = list.size();
+                std::string range = list.substr(pos, end - pos);
+                size_t dash = range.find('-');
+                try {
+                    int from = std::stoi(range.substr(0, dash));
+                    int to = dash == std::string::npos ? from : std::stoi(range.substr(dash + 1));
+                    for (int i = from; i <= to; ++i) result.push_back(i);
+                } catch (const std::exception &) {
+                    return std::vector<int>();
+                }
+                pos = end + 1;
+            }
+            return result;
+        }
+
+        long set_policy(int mode, int node) {
+            unsigned long mask[MaxNodes / (8 * sizeof(unsigned long))] = {0};
+            mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+            return syscall(SYS_set_mempolicy, mode, mask, MaxNodes + 1);
+        }
+    }
+
+    ThreadPlacement::ThreadPlacement(const std::vector<int> &cpus) : cpus_(cpus),
+                                                                     node_(cpus.empty() ? -1 : numa_node_of_cpu(
+                                                                             cpus.front())) { }
+
+    ThreadPlacement ThreadPlacement::node(int node) {
+        ThreadPlacement placement(numa_node_cpus(node));
+        placement.node_ = node;
+        return placement;
+    }
+
+    bool ThreadPlacement::apply() {
+        if (cpus_.empty()) return true;
+        cpu_set_t set;
+        if (!fill_cpu_set(cpus_, set)) {
+            set_error(EINVAL, "Invalid CPU set");
+            return false;
+        }
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+            set_error();
+            return false;
+        }
+        if (local_memory_ && node_ >= 0 && static_cast<size_t>(node_) < MaxNodes &&
+            set_policy(PolicyPreferred, node_) < 0) {
+            set_error();
+            return false;
+        }
+        return true;
+    }
+
+    bool ThreadPlacement::apply(std::thread &thread) {
+        if (cpus_.empty()) return true;
+        cpu_set_t set;
+        if (!fill_cpu_set(cpus_, set)) {
+            set_error(EINVAL, "Invalid CPU set");
+            return false;
+        }
+        int res = pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+        if (res != 0) {
+            set_error(res, "");
+            return false;
+        }
+        return true;
+    }
+
+    int current_cpu() {
+        return sched_getcpu();
+    }
+
+    int numa_node_of_cpu(int cpu) {
+        std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+        DIR *dir = opendir(path.c_str());
+        if (dir == nullptr) return -1;
+        int node = -1;
+        while (dirent *entry = readdir(dir)) {
+            if (strncmp(entry->d_name, "node", 4) == 0 && isdigit(entry->d_name[4])) {
+                node = atoi(entry->d_name + 4);
+                break;
+            }
+        }
+        closedir(dir);
+        return node;
+    }
+
+    std::vector<int> numa_node_cpus(int node) {
+        std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        std::string list;
+        if (!std::getline(file, list)) return std::vector<int>();
+        return parse_list(list);
+    }
+
+    bool bind_memory(void *address, size_t size, int node) {
+        if (node < 0 || static_cast<size_t>(node) >= MaxNodes) return false;
+        uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+        uintptr_t begin = (reinterpret_cast<uintptr_t>(address) + page - 1) & ~(page - 1);
+        uintptr_t end = (reinterpret_cast<uintptr_t>(address) + size) & ~(page - 1);
+        if (end <= begin) return true; // Nothing page aligned: first touch decides
+        unsigned long mask[MaxNodes / (8 * sizeof(unsigned long))] = {0};
+        mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+        return syscall(SYS_mbind, begin, end - begin, PolicyBind, mask, MaxNodes + 1, 0) == 0;
+    }
+}
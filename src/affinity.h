@@ -0,0 +1,86 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+#ifndef IO_AFFINITY_H
+#define IO_AFFINITY_H
+
+#include "io.h"
+#include <thread>
+#include <vector>
+
+namespace io {
+
+    /**
+     * Placement of reactor or worker thread: CPU set and NUMA memory policy. Libnuma is not required.
+     * Apply it at the start of thread which polls Epoll: clients accepted there get their
+     * FileStream buffers allocated (first touched) on the same node.
+     */
+    struct ThreadPlacement : public WithError {
+
+        /**
+         * Empty placement: apply() does nothing
+         */
+        ThreadPlacement() { }
+
+        /**
+         * Placement on CPU set `cpus`. NUMA node is detected by first CPU
+         */
+        explicit ThreadPlacement(const std::vector<int> &cpus);
+
+        /**
+         * Placement on all CPUs of NUMA `node`
+         */
+        static ThreadPlacement node(int node);
+
+        inline const std::vector<int> &cpus() const { return cpus_; }
+
+        /**
+         * NUMA node of CPU set or -1 if unknown
+         */
+        inline int numa_node() const { return node_; }
+
+        /**
+         * Prefer memory of local NUMA node for allocations of placed thread (enabled by default)
+         */
+        inline void set_local_memory(bool enable) { local_memory_ = enable; }
+
+        inline bool local_memory() const { return local_memory_; }
+
+        /**
+         * Pin calling thread to CPU set and set memory policy. Returns false on error
+         */
+        bool apply();
+
+        /**
+         * Pin other `thread` to CPU set. Memory policy can be set only from thread itself (see apply())
+         */
+        bool apply(std::thread &thread);
+
+    private:
+        std::vector<int> cpus_;
+        int node_ = -1;
+        bool local_memory_ = true;
+    };
+
+    /**
+     * CPU of calling thread or -1
+     */
+    int current_cpu();
+
+    /**
+     * NUMA node of `cpu` or -1 if system has no NUMA information
+     */
+    int numa_node_of_cpu(int cpu);
+
+    /**
+     * CPUs of NUMA `node`. Empty on error
+     */
+    std::vector<int> numa_node_cpus(int node);
+
+    /**
+     * Bind memory region (page aligned part of it) to NUMA `node` with mbind(2). Returns false on error
+     */
+    bool bind_memory(void *address, size_t size, int node);
+}
+#endif //IO_AFFINITY_H
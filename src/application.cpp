@@ -3,17 +3,75 @@
 //
 
 #include "application.h"
+#include "async.h"
 #include <csignal>
 #include <cstdlib>
+#include <pthread.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
 
 namespace io {
 
     void Application::add_signal_handler(int sig, const Callback &func) {
-        if (on_sig_.find(sig) == on_sig_.end())
-            signal(sig, &Application::signal_handler);
+        if (on_sig_.find(sig) == on_sig_.end()) {
+            if (attached()) {
+                sigaddset(&mask_, sig);
+                pthread_sigmask(SIG_BLOCK, &mask_, nullptr);
+                signalfd(signal_fd_, &mask_, 0);
+            } else {
+                signal(sig, &Application::signal_handler);
+            }
+        }
         on_sig_.insert(std::make_pair(sig, func));
     }
 
+    bool Application::attach(Epoll &epoll) {
+        if (attached()) return false;
+        sigemptyset(&mask_);
+        for (auto &kv:on_sig_) sigaddset(&mask_, kv.first);
+        if (pthread_sigmask(SIG_BLOCK, &mask_, nullptr) != 0) return false;
+        signal_fd_ = signalfd(-1, &mask_, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (signal_fd_ < 0) {
+            pthread_sigmask(SIG_UNBLOCK, &mask_, nullptr);
+            return false;
+        }
+        if (!epoll.add<Application, &Application::on_signal_event>(signal_fd_, EPOLLIN, this)) {
+            ::close(signal_fd_);
+            signal_fd_ = -1;
+            pthread_sigmask(SIG_UNBLOCK, &mask_, nullptr);
+            return false;
+        }
+        epoll_ = &epoll;
+        return true;
+    }
+
+    void Application::detach() {
+        if (!attached()) return;
+        epoll_->remove(signal_fd_);
+        ::close(signal_fd_);
+        signal_fd_ = -1;
+        epoll_ = nullptr;
+        for (auto &kv:on_sig_) signal(kv.first, &Application::signal_handler);
+        pthread_sigmask(SIG_UNBLOCK, &mask_, nullptr);
+    }
+
+    void Application::on_signal_event(Epoll &, uint32_t events, int fd) {
+        signalfd_siginfo info[16];
+        uint64_t pending = 0; // Standard signals are merged anyway, so one call per signal number
+        std::vector<int> extra;
+        ssize_t n;
+        while ((n = read(fd, info, sizeof(info))) > 0) {
+            for (size_t i = 0; i < static_cast<size_t>(n) / sizeof(signalfd_siginfo); ++i) {
+                int sig = static_cast<int>(info[i].ssi_signo);
+                if (sig < 64) pending |= 1ULL << sig;
+                else extra.push_back(sig);
+            }
+        }
+        for (int sig = 1; sig < 64; ++sig)
+            if (pending & (1ULL << sig)) on_signal(sig);
+        for (int sig:extra) on_signal(sig);
+    }
+
     void Application::add_exit_handler(const Callback &func) {
         if (on_exit_.empty()) atexit(&Application::exit_handler);
         on_exit_.push_back(func);
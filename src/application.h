@@ -8,8 +8,12 @@
 #include <functional>
 #include <vector>
 #include <unordered_map>
+#include <csignal>
+#include <cstdint>
 
 namespace io {
+    struct Epoll;
+
     struct Application {
         typedef std::function<void()> Callback;
 
@@ -31,9 +35,29 @@ namespace io {
          */
         void add_exit_handler(const Callback &func);
 
+        /**
+         * Deliver registered signals through signalfd on `epoll` instead of classic signal handlers.
+         * Signals are blocked for calling thread and threads created after it, so call it before spawning threads.
+         * Handlers run as regular epoll callbacks; repeated signals between two polls are merged to one call.
+         * Returns false on error
+         */
+        bool attach(Epoll &epoll);
+
+        /**
+         * Return to classic signal handlers and unblock signals
+         */
+        void detach();
+
+        /**
+         * Are signals delivered through epoll
+         */
+        inline bool attached() const { return signal_fd_ >= 0; }
+
     private:
         void on_signal(int sig);
 
+        void on_signal_event(Epoll &, uint32_t events, int fd);
+
         void on_exit();
 
         static void signal_handler(int sig);
@@ -49,6 +73,12 @@ namespace io {
         std::unordered_multimap<int, Callback> on_sig_;
 
         std::vector<Callback> on_exit_;
+
+        sigset_t mask_;
+
+        int signal_fd_ = -1;
+
+        Epoll *epoll_ = nullptr;
     };
 }
 #endif //IO_APPLICATION_H
@@ -3,19 +3,45 @@
 //
 
 #include "async.h"
+#include "trace.h"
+#include "engine.h"
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 
 namespace io {
-    Epoll::Epoll(size_t cache_size, int flags) : events_cache_(cache_size) {
+    Epoll::Epoll(size_t cache_size, int flags) : events_cache_(cache_size), tasks_(new MpscQueue<Task>()) {
         descriptor_ = epoll_create1(flags);
-        if (!has_valid_descriptor()) set_error();
         set_auto_close(true);
+        if (!has_valid_descriptor()) {
+            set_error();
+            return;
+        }
+        wakeup_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wakeup_fd_ < 0) {
+            set_error();
+            return;
+        }
+        if (!add(wakeup_fd_, EPOLLIN, [](Epoll &epoll, uint32_t, int) { epoll.run_posted(); })) {
+            ::close(wakeup_fd_);
+            wakeup_fd_ = -1;
+        }
     }
 
     Epoll::Epoll(Epoll &&that) {
         descriptor_ = that.descriptor_;
         events_cache_ = that.events_cache_;
-        callbacks_ = that.callbacks_;
+        callbacks_ = std::move(that.callbacks_);
+        tasks_ = std::move(that.tasks_);
+        wakeup_fd_ = that.wakeup_fd_;
         that.descriptor_ = -1;
+        that.wakeup_fd_ = -1;
         that.events_cache_.clear();
         that.callbacks_.clear();
     }
@@ -24,9 +50,33 @@ namespace io {
         std::swap(descriptor_, that.descriptor_);
         std::swap(events_cache_, that.events_cache_);
         std::swap(callbacks_, that.callbacks_);
+        std::swap(tasks_, that.tasks_);
+        std::swap(wakeup_fd_, that.wakeup_fd_);
         return *this;
     }
 
+    Epoll::~Epoll() {
+        if (wakeup_fd_ >= 0) ::close(wakeup_fd_);
+    }
+
+    bool Epoll::post(Epoll::Task task) {
+        if (wakeup_fd_ < 0 || !tasks_) return false;
+        if (tasks_->push(std::move(task))) { // First task after drain wakes up the loop
+            uint64_t one = 1;
+            if (write(wakeup_fd_, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+                set_error();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void Epoll::run_posted() {
+        uint64_t counter;
+        if (read(wakeup_fd_, &counter, sizeof(counter)) < 0 && errno != EAGAIN) set_error();
+        tasks_->drain([](Task &task) { if (task) task(); });
+    }
+
     bool Epoll::add(int fd, uint32_t events_filter, const Epoll::Callback &callback) {
         if (!has_valid_descriptor() || fd < 0)return false;
         epoll_event event;
@@ -59,7 +109,7 @@ namespace io {
         return ok;
     }
 
-    bool Epoll::update(int fd, Epoll::Callback &callback) {
+    bool Epoll::update(int fd, const Epoll::Callback &callback) {
         if (!has_valid_descriptor() || fd < 0)return false;
         auto iter = callbacks_.find(fd);
         if (iter == callbacks_.end())return false;
@@ -72,16 +122,41 @@ namespace io {
             set_error(-1, "Invalid descriptor");
             return -1;
         }
-        int res = epoll_wait(descriptor_, events_cache_.data(), events_cache_.size(), timeout);
+        int res;
+        {
+            trace::Span span(trace::PollWait, descriptor_);
+            res = epoll_wait(descriptor_, events_cache_.data(), events_cache_.size(), timeout);
+            span.set_arg(static_cast<uint64_t>(res < 0 ? 0 : res));
+        }
         if (res >= 0)
             for (int i = 0; i < res; ++i) {
-                callbacks_[events_cache_[i].data.fd](*this, events_cache_[i].events, events_cache_[i].data.fd);
+                int fd = events_cache_[i].data.fd;
+                auto callback = callbacks_.find(fd);
+                if (callback == callbacks_.end() || !callback->second) continue; // Removed by previous callback
+                trace::Span span(trace::Callback, fd, events_cache_[i].events);
+                callback->second(*this, events_cache_[i].events, fd);
             }
         else
             set_error();
         return res;
     }
 
+    int Epoll::run_busy(uint64_t spin_budget, int timeout) {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        uint64_t deadline = static_cast<uint64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000 + spin_budget;
+        while (true) {
+            int res = poll(0);
+            if (res != 0) return res;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (static_cast<uint64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000 >= deadline) break;
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+        }
+        return poll(timeout);
+    }
+
     AsyncSocketServer::AsyncSocketServer(io::Epoll &epoll, io::ConnectionManager::Ptr serv_con_) : poller_(epoll),
                                                                                                    server_(serv_con_),
                                                                                                    server_fd_(
@@ -90,22 +165,166 @@ namespace io {
                                                                                                                      : -1) {
         running_ = serv_con_ && poller_.has_valid_descriptor() &&
                    serv_con_->has_valid_descriptor() &&
-                   poller_.add(server_fd_, EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP,
-                               &AsyncSocketServer::on_server_event,
-                               this);
+                   poller_.add<AsyncSocketServer, &AsyncSocketServer::on_server_event>(
+                           server_fd_, EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP, this);
         if (running_) on_server_start();
     }
 
+    static uint64_t monotonic_ns() {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return static_cast<uint64_t>(now.tv_sec) * 1000000000ULL + static_cast<uint64_t>(now.tv_nsec);
+    }
+
+    bool AsyncSocketServer::set_admission(const AdmissionLimits &limits) {
+        limits_ = limits;
+        tokens_ = limits_.accept_burst > 0 ? static_cast<double>(limits_.accept_burst)
+                                           : std::max(1.0, limits_.accept_rate);
+        refilled_at_ = monotonic_ns();
+        if (timer_fd_ < 0) {
+            timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+            if (timer_fd_ < 0) return false;
+            if (!poller_.add<AsyncSocketServer, &AsyncSocketServer::on_resume_timer>(timer_fd_, EPOLLIN, this)) {
+                ::close(timer_fd_);
+                timer_fd_ = -1;
+                return false;
+            }
+        }
+        if (limits_.reserve_descriptor && reserve_fd_ < 0) {
+            reserve_fd_ = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        } else if (!limits_.reserve_descriptor && reserve_fd_ >= 0) {
+            ::close(reserve_fd_);
+            reserve_fd_ = -1;
+        }
+        resume(Rate);
+        if (limits_.max_clients > 0 && clients_.size() >= limits_.max_clients) pause(Capacity);
+        else resume(Capacity);
+        return true;
+    }
+
+    bool AsyncSocketServer::admit() {
+        if (limits_.max_clients > 0 && clients_.size() >= limits_.max_clients) {
+            pause(Capacity);
+            return false;
+        }
+        if (limits_.accept_rate > 0) {
+            double burst = limits_.accept_burst > 0 ? static_cast<double>(limits_.accept_burst)
+                                                    : std::max(1.0, limits_.accept_rate);
+            uint64_t now = monotonic_ns();
+            tokens_ = std::min(burst, tokens_ + static_cast<double>(now - refilled_at_) * 1e-9 * limits_.accept_rate);
+            refilled_at_ = now;
+            if (tokens_ < 1) {
+                pause(Rate, static_cast<uint64_t>((1 - tokens_) / limits_.accept_rate * 1e9) + 1);
+                return false;
+            }
+            tokens_ -= 1;
+        }
+        return true;
+    }
+
+    void AsyncSocketServer::shed() {
+        if (reserve_fd_ >= 0) { // Free one descriptor to accept and close client instead of leaving it in backlog
+            ::close(reserve_fd_);
+            reserve_fd_ = -1;
+            int client_fd = server_->next_descriptor();
+            if (client_fd >= 0) {
+                ::close(client_fd);
+                server_->on_descriptor_closed(client_fd);
+                ++shed_;
+            }
+            if (limits_.reserve_descriptor) reserve_fd_ = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        }
+        pause(Overload, limits_.overload_pause * 1000000ULL);
+    }
+
+    void AsyncSocketServer::pause(uint32_t reason, uint64_t delay_ns) {
+        if (delay_ns > 0) {
+            if (timer_fd_ < 0) return; // Can't resume later
+            uint64_t until = monotonic_ns() + delay_ns;
+            if (reason & Rate) rate_until_ = until;
+            if (reason & Overload) overload_until_ = until;
+            arm_resume_timer();
+        }
+        if (paused_ == 0 && running_) poller_.update(server_fd_, 0);
+        paused_ |= reason;
+    }
+
+    void AsyncSocketServer::resume(uint32_t reason) {
+        if ((reason & Rate) && rate_until_ != 0) {
+            rate_until_ = 0;
+            arm_resume_timer();
+        }
+        if ((reason & Overload) && overload_until_ != 0) {
+            overload_until_ = 0;
+            arm_resume_timer();
+        }
+        if ((paused_ & reason) == 0) return;
+        paused_ &= ~reason;
+        if (paused_ == 0 && running_) poller_.update(server_fd_, EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP);
+    }
+
+    void AsyncSocketServer::arm_resume_timer() {
+        if (timer_fd_ < 0) return;
+        uint64_t until = 0;
+        for (uint64_t deadline:{rate_until_, overload_until_})
+            if (deadline != 0 && (until == 0 || deadline < until)) until = deadline;
+        itimerspec spec = {}; // Zero disarms
+        spec.it_value.tv_sec = static_cast<time_t>(until / 1000000000ULL);
+        spec.it_value.tv_nsec = static_cast<long>(until % 1000000000ULL);
+        timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &spec, nullptr);
+    }
+
+    void AsyncSocketServer::on_resume_timer(io::Epoll &, uint32_t, int fd) {
+        uint64_t expirations;
+        while (read(fd, &expirations, sizeof(expirations)) > 0);
+        uint64_t now = monotonic_ns();
+        uint32_t expired = 0; // Only reasons whose own deadline has passed
+        if (rate_until_ != 0 && rate_until_ <= now) expired |= Rate;
+        if (overload_until_ != 0 && overload_until_ <= now) expired |= Overload;
+        if (expired != 0) resume(expired);
+        else arm_resume_timer();
+    }
+
     void AsyncSocketServer::stop() {
+        if (timer_fd_ >= 0) {
+            poller_.remove(timer_fd_);
+            ::close(timer_fd_);
+            timer_fd_ = -1;
+        }
+        if (budget_timer_fd_ >= 0) {
+            poller_.remove(budget_timer_fd_);
+            ::close(budget_timer_fd_);
+            budget_timer_fd_ = -1;
+        }
+        if (reserve_fd_ >= 0) {
+            ::close(reserve_fd_);
+            reserve_fd_ = -1;
+        }
+        paused_ = 0;
+        rate_until_ = overload_until_ = 0;
         if (running_) {
             on_server_stopping();
+            for (auto &client:clients_.clear()) {
+                int client_fd = client->descriptor();
+                trace::instant(trace::Disconnect, client_fd);
+                poller_.remove(client_fd);
+                client->hangup(); // Publisher may still write, descriptor is closed with last reference
+                server_->on_descriptor_closed(client_fd);
+            }
+            poller_.remove(server_fd_);
             {
-                auto lock = lock_collection();
-                for (auto &it:clients_)
-                    it.second->close();
-                clients_.clear();
-                poller_.remove(server_fd_);
+                std::lock_guard<std::mutex> guard(lines_lock_);
+                lines_.clear();
             }
+            {
+                std::lock_guard<std::mutex> guard(memory_lock_);
+                for (auto &item:memory_) { // Shared charges stay
+                    memory_usage_.fetch_sub(static_cast<int64_t>(item.second->accounted.exchange(0)) +
+                                            item.second->charged);
+                }
+                memory_.clear();
+            }
+            throttled_ = false;
             running_ = false;
             on_server_stopped();
         }
@@ -119,15 +338,53 @@ namespace io {
         if (events & EPOLLERR) {
             stop();
         } else if (events & EPOLLIN) {
+            if (!admit()) return;
+            errno = 0;
             int client_fd = server_->next_descriptor();
-            if (client_fd < 0) stop();
-            else {
+            if (client_fd < 0) {
+                switch (errno) {
+                    case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+                    case EWOULDBLOCK:
+#endif
+                    case EINTR:
+                    case ECONNABORTED:
+                    case EPROTO:
+                        break; // Transient, client is gone or will be retried
+                    case EMFILE:
+                    case ENFILE:
+                    case ENOBUFS:
+                    case ENOMEM:
+                        shed();
+                        break;
+                    default:
+                        stop();
+                }
+            } else {
+                trace::instant(trace::Accept, client_fd);
+                if (timestamping_) enable_timestamping(client_fd, transmit_timestamps_);
                 auto client = io::FileStream::create(client_fd);
                 on_client_connected(client);
-                {
-                    std::lock_guard<std::mutex> guard(lock_);
-                    clients_[client_fd] = client;
+                clients_.insert(client_fd, client);
+                if (!poller_.add<AsyncSocketServer, &AsyncSocketServer::on_client_event>(
+                        client_fd, EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP, this)) {
+                    clients_.erase(client_fd);
+                    trace::instant(trace::Disconnect, client_fd);
+                    client->close();
+                    server_->on_descriptor_closed(client_fd);
+                } else if (accounting_) {
+                    auto memory = std::make_shared<ClientMemory>();
+                    {
+                        std::lock_guard<std::mutex> guard(memory_lock_);
+                        memory_[client_fd] = memory;
+                    }
+                    {
+                        std::lock_guard<std::mutex> busy(memory->lock);
+                        account(client, client_fd, *memory);
+                    }
+                    enforce_budget();
                 }
+                if (limits_.max_clients > 0 && clients_.size() >= limits_.max_clients) pause(Capacity);
             }
         }
     }
@@ -135,59 +392,682 @@ namespace io {
     void AsyncSocketServer::on_client_event(io::Epoll &, uint32_t events, int client_fd) {
         auto client = find_client_by_descriptor(client_fd);
         if (!client) return; //Already removed
-        if (events & (EPOLLERR)) {
-            client->close();
-        } else if (events & (EPOLLHUP | EPOLLRDHUP)) {
-            on_client_disconnected(client);
-            client->close();
-            {
-                std::lock_guard<std::mutex> guard(lock_);
-                clients_.erase(client_fd);
-                poller_.remove(client_fd);
-            }
+        std::shared_ptr<ClientMemory> memory;
+        std::unique_lock<std::mutex> busy;
+        if (accounting_ && (memory = client_memory(client_fd))) {
+            busy = std::unique_lock<std::mutex>(memory->lock);
+            if (memory->closed) return; // Shed while waiting
+        }
+        if (timestamping_) events = take_timestamps(client, client_fd, events);
+        if (line_mode_ && (events & EPOLLIN)) { // Take data sent before hangup too
+            if (!read_lines(client, client_fd)) disconnect(client, client_fd);
+            else if (events & (EPOLLERR | EPOLLHUP)) disconnect(client, client_fd);
+        } else if (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+            disconnect(client, client_fd);
         } else if (events & (EPOLLIN)) {
             on_client_data_ready(client);
         } else {
             //STUB for future events
         }
+        if (memory) {
+            if (!memory->closed) {
+                if (budget_.limit > 0 && memory_usage() > budget_.limit) shrink(client, client_fd, true);
+                account(client, client_fd, *memory);
+                // Buffered input is kept reading while throttled: it can drain only with more data
+                if (throttled_) set_reading(client_fd, *memory, holds_input(client, client_fd));
+            }
+            busy.unlock();
+            enforce_budget();
+        }
+    }
+
+    void AsyncSocketServer::disconnect(const io::FileStream::Ptr &client, int client_fd) {
+        if (clients_.erase(client_fd)) { // Other thread may handle same disconnect
+            on_client_disconnected(client);
+            trace::instant(trace::Disconnect, client_fd); // Once per client on every path (HUP, ERR, shed)
+            poller_.remove(client_fd);
+            client->hangup(); // Broadcasts over old snapshots may still write, descriptor is closed with last reference
+            server_->on_descriptor_closed(client_fd);
+            if ((paused_ & Capacity) && clients_.size() < limits_.max_clients) resume(Capacity);
+        }
+        {
+            std::lock_guard<std::mutex> guard(lines_lock_);
+            lines_.erase(client_fd);
+        }
+        if (accounting_) { // Client lock is held by caller
+            std::lock_guard<std::mutex> guard(memory_lock_);
+            auto found = memory_.find(client_fd);
+            if (found != memory_.end()) {
+                auto &memory = *found->second;
+                memory.closed = true;
+                memory_usage_.fetch_sub(static_cast<int64_t>(memory.accounted.exchange(0)) + memory.charged);
+                memory_.erase(found);
+            }
+        }
+    }
+
+    void AsyncSocketServer::set_memory_budget(const MemoryBudget &budget) {
+        budget_ = budget;
+        if (budget_timer_fd_ < 0) {
+            budget_timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+            if (budget_timer_fd_ >= 0 && !poller_.add<AsyncSocketServer, &AsyncSocketServer::on_budget_timer>(
+                    budget_timer_fd_, EPOLLIN, this)) {
+                ::close(budget_timer_fd_);
+                budget_timer_fd_ = -1;
+            }
+        }
+        if (!accounting_) {
+            accounting_ = true;
+            auto clients = clients_.snapshot();
+            for (auto &client:*clients) {
+                int client_fd = client->descriptor();
+                if (client_fd < 0) continue;
+                auto memory = std::make_shared<ClientMemory>();
+                {
+                    std::lock_guard<std::mutex> guard(memory_lock_);
+                    memory_[client_fd] = memory;
+                }
+                std::lock_guard<std::mutex> busy(memory->lock);
+                account(client, client_fd, *memory);
+            }
+        }
+        enforce_budget();
     }
 
-    std::unique_lock<std::mutex> AsyncSocketServer::lock_collection() {
-        return std::unique_lock<std::mutex>(lock_);
+    std::shared_ptr<AsyncSocketServer::ClientMemory> AsyncSocketServer::client_memory(int client_fd) const {
+        std::lock_guard<std::mutex> guard(memory_lock_);
+        auto found = memory_.find(client_fd);
+        return found != memory_.end() ? found->second : nullptr;
+    }
+
+    size_t AsyncSocketServer::client_memory_usage(int fd) const {
+        std::lock_guard<std::mutex> guard(memory_lock_);
+        auto found = memory_.find(fd);
+        if (found == memory_.end()) return 0;
+        int64_t usage = static_cast<int64_t>(found->second->accounted.load()) + found->second->charged;
+        return usage > 0 ? static_cast<size_t>(usage) : 0;
+    }
+
+    void AsyncSocketServer::charge_client(int fd, int64_t bytes) {
+        {
+            std::lock_guard<std::mutex> guard(memory_lock_);
+            auto found = memory_.find(fd);
+            if (found == memory_.end()) return;
+            found->second->charged += bytes;
+            memory_usage_.fetch_add(bytes);
+        }
+        enforce_budget();
+    }
+
+    void AsyncSocketServer::charge(int64_t bytes) {
+        memory_usage_.fetch_add(bytes);
+        if (accounting_) enforce_budget();
+    }
+
+    void AsyncSocketServer::account(const io::FileStream::Ptr &client, int client_fd, ClientMemory &memory) {
+        size_t usage = client->memory_usage();
+        {
+            std::lock_guard<std::mutex> guard(lines_lock_);
+            auto found = lines_.find(client_fd);
+            if (found != lines_.end()) usage += found->second->data.capacity();
+        }
+        size_t previous = memory.accounted.exchange(usage);
+        memory_usage_.fetch_add(static_cast<int64_t>(usage) - static_cast<int64_t>(previous));
+    }
+
+    size_t AsyncSocketServer::shrink(const io::FileStream::Ptr &client, int client_fd, bool output) {
+        // Output may be written from other threads (Publisher), so only owner of event shrinks it
+        size_t released = client->shrink(true, output);
+        std::lock_guard<std::mutex> guard(lines_lock_);
+        auto found = lines_.find(client_fd);
+        if (found != lines_.end() && found->second->size == 0) {
+            released += found->second->data.capacity();
+            std::vector<char>().swap(found->second->data);
+            found->second->scanned = 0;
+        }
+        return released;
+    }
+
+    void AsyncSocketServer::enforce_budget() {
+        std::unique_lock<std::mutex> guard(reclaim_lock_, std::try_to_lock);
+        if (!guard.owns_lock()) return; // Other thread reclaims
+        size_t limit = budget_.limit;
+        if (limit == 0) {
+            throttle(false);
+            return;
+        }
+        if (memory_usage() > limit && budget_.shrink_idle) {
+            uint64_t now = monotonic_ns();
+            if (now - reclaimed_at_ >= 10000000ULL) { // Full pass at most every 10ms
+                reclaimed_at_ = now;
+                auto clients = clients_.snapshot();
+                for (auto &client:*clients) {
+                    if (memory_usage() <= limit) break;
+                    int client_fd = client->descriptor();
+                    auto memory = client_fd >= 0 ? client_memory(client_fd) : nullptr;
+                    if (!memory || !memory->lock.try_lock()) continue; // Busy clients shrink themselves
+                    if (!memory->closed && shrink(client, client_fd, false) > 0) account(client, client_fd, *memory);
+                    memory->lock.unlock();
+                }
+            }
+        }
+        if (memory_usage() > limit && budget_.throttle) throttle(true);
+        if (memory_usage() > limit && budget_.shed_largest) {
+            std::vector<std::pair<int64_t, int>> usage; // Bytes and descriptor
+            {
+                std::lock_guard<std::mutex> lock(memory_lock_);
+                for (auto &item:memory_)
+                    usage.emplace_back(static_cast<int64_t>(item.second->accounted.load()) + item.second->charged,
+                                       item.first);
+            }
+            std::sort(usage.begin(), usage.end(), std::greater<std::pair<int64_t, int>>());
+            for (auto &item:usage) {
+                if (memory_usage() <= limit) break;
+                auto client = find_client_by_descriptor(item.second);
+                auto memory = client_memory(item.second);
+                if (!client || !memory || !memory->lock.try_lock()) continue;
+                if (!memory->closed) {
+                    disconnect(client, item.second);
+                    ++memory_shed_;
+                }
+                memory->lock.unlock();
+            }
+        }
+        if (throttled_ && memory_usage() <= static_cast<size_t>(limit * budget_.resume_ratio)) throttle(false);
+    }
+
+    void AsyncSocketServer::throttle(bool enable) {
+        if (throttled_ == enable) return;
+        throttled_ = enable;
+        if (enable) pause(Memory);
+        else resume(Memory);
+        if (budget_timer_fd_ >= 0) { // Re-check periodically: usage may drop without events
+            itimerspec spec = {};
+            if (enable) spec.it_value.tv_nsec = spec.it_interval.tv_nsec = 100000000L;
+            timerfd_settime(budget_timer_fd_, 0, &spec, nullptr);
+        }
+        auto clients = clients_.snapshot();
+        for (auto &client:*clients) {
+            int client_fd = client->descriptor();
+            auto memory = client_fd >= 0 ? client_memory(client_fd) : nullptr;
+            if (!memory) continue;
+            if (!enable) {
+                set_reading(client_fd, *memory, true);
+            } else if (memory->lock.try_lock()) { // Busy clients decide after their event
+                if (!memory->closed) set_reading(client_fd, *memory, holds_input(client, client_fd));
+                memory->lock.unlock();
+            }
+        }
+    }
+
+    bool AsyncSocketServer::holds_input(const io::FileStream::Ptr &client, int client_fd) {
+        if (client->input_buffered() > 0) return true;
+        std::lock_guard<std::mutex> guard(lines_lock_);
+        auto found = lines_.find(client_fd);
+        return found != lines_.end() && found->second->size > 0;
+    }
+
+    void AsyncSocketServer::set_reading(int client_fd, ClientMemory &memory, bool enable) {
+        std::lock_guard<std::mutex> guard(memory.interest);
+        bool pause = !enable && throttled_; // Checked under lock: throttle(false) can't be missed
+        if (memory.paused == pause) return;
+        memory.paused = pause;
+        poller_.update(client_fd, EPOLLERR | EPOLLHUP | EPOLLRDHUP | (pause ? 0 : EPOLLIN));
+    }
+
+    void AsyncSocketServer::on_budget_timer(io::Epoll &, uint32_t, int fd) {
+        uint64_t expirations;
+        while (read(fd, &expirations, sizeof(expirations)) > 0);
+        enforce_budget();
+    }
+
+    thread_local uint64_t AsyncSocketServer::received_at_ = 0;
+
+    void AsyncSocketServer::set_timestamping(bool enable, bool transmit) {
+        timestamping_ = enable;
+        transmit_timestamps_ = enable && transmit;
+    }
+
+    uint32_t AsyncSocketServer::take_timestamps(const io::FileStream::Ptr &client, int client_fd, uint32_t events) {
+        if ((events & EPOLLERR) && transmit_timestamps_) {
+            std::vector<io::TransmitTimestamp> stamps;
+            if (read_transmit_timestamps(client_fd, stamps) > 0) on_client_transmitted(client, stamps);
+            int error = 0;
+            socklen_t length = sizeof(error);
+            // Only error queue was not empty: it's not a failure of socket
+            if (getsockopt(client_fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0)
+                events &= ~EPOLLERR;
+        }
+        received_at_ = 0;
+        if (events & EPOLLIN) {
+            char byte;
+            uint64_t arrived = 0;
+            if (receive_timestamped(client_fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT, &arrived) > 0 && arrived > 0) {
+                uint64_t now = timestamp_now();
+                receive_latency_.record(now > arrived ? now - arrived : 0); // Realtime clock may step back
+                received_at_ = arrived;
+            }
+        }
+        return events;
+    }
+
+    void AsyncSocketServer::set_line_mode(bool enable, size_t max_line) {
+        line_mode_ = enable;
+        max_line_ = max_line > 0 ? max_line : 1;
+        if (!enable) {
+            std::lock_guard<std::mutex> guard(lines_lock_);
+            lines_.clear();
+        }
+    }
+
+    bool AsyncSocketServer::read_lines(const io::FileStream::Ptr &client, int client_fd) {
+        std::shared_ptr<LineBuffer> buffer;
+        {
+            std::lock_guard<std::mutex> guard(lines_lock_);
+            auto &slot = lines_[client_fd];
+            if (!slot) slot = std::make_shared<LineBuffer>();
+            buffer = slot;
+        }
+        std::lock_guard<std::mutex> busy(buffer->lock); // Lines of client are read and delivered in order
+        const size_t chunk = 16384;
+        bool open = true;
+        for (int reads = 0; reads < 16 && open; ++reads) { // Bounded to keep other clients served
+            if (buffer->data.size() < buffer->size + chunk) buffer->data.resize(buffer->size + chunk);
+            ssize_t n = recv(client_fd, &buffer->data[buffer->size], chunk, MSG_DONTWAIT);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (n <= 0) {
+                open = false;
+                break;
+            }
+            buffer->size += static_cast<size_t>(n);
+            size_t start = 0; // Begin of current line
+            while (true) { // Scan only new bytes
+                char *base = &buffer->data[0];
+                char *eol = static_cast<char *>(memchr(base + buffer->scanned, '\n', buffer->size - buffer->scanned));
+                if (eol == nullptr) {
+                    buffer->scanned = buffer->size;
+                    break;
+                }
+                size_t length = static_cast<size_t>(eol - (base + start));
+                if (length > 0 && base[start + length - 1] == '\r') --length;
+                if (length > max_line_) {
+                    on_client_line_too_long(client);
+                    return false;
+                }
+                on_client_line(client, base + start, length);
+                if (!client->has_valid_descriptor()) return false; // Closed by handler
+                start = static_cast<size_t>(eol - base) + 1;
+                buffer->scanned = start;
+            }
+            if (start > 0) { // Keep only incomplete line
+                std::memmove(&buffer->data[0], &buffer->data[start], buffer->size - start);
+                buffer->size -= start;
+                buffer->scanned -= start;
+            }
+            if (buffer->size > max_line_ + 1) { // +1 for possible \r
+                on_client_line_too_long(client);
+                return false;
+            }
+        }
+        if (!open && buffer->size > 0) { // Unterminated tail
+            size_t length = buffer->size;
+            if (buffer->data[length - 1] == '\r') --length;
+            on_client_line(client, &buffer->data[0], length);
+            buffer->size = buffer->scanned = 0;
+        }
+        if (buffer->data.size() > max_line_ + chunk && buffer->size < chunk) { // Shrink after long line
+            buffer->data.resize(chunk);
+            buffer->data.shrink_to_fit();
+        }
+        return open;
     }
 
 
     AbstractAsyncFile::AbstractAsyncFile(io::Storage &storage, io::Epoll &epoll, uint32_t custom_events) : file_d(
-            storage), epoll_(epoll) {
-        if (file_d.has_valid_descriptor() && epoll.has_valid_descriptor() &&
-            epoll.add(file_d.descriptor(), EPOLLIN | EPOLLERR | EPOLLRDHUP | EPOLLHUP | custom_events,
-                      &AbstractAsyncFile::process_event,
-                      this)) {
+            storage), epoll_(epoll), events_(EPOLLIN | EPOLLERR | EPOLLRDHUP | EPOLLHUP | custom_events) {
+        if (!file_d.has_valid_descriptor() || !epoll.has_valid_descriptor()) return;
+        struct stat info;
+        if (fstat(file_d.descriptor(), &info) == 0 && S_ISREG(info.st_mode)) { // Epoll rejects regular files
+            engine_ = &FileEngine::shared();
+            off_t position = lseek(file_d.descriptor(), 0, SEEK_CUR);
+            read_offset_ = write_offset_ = position > 0 ? position : 0;
+            on_start();
+            notify_data(); // Regular file is always readable
+        } else if (epoll.add<AbstractAsyncFile, &AbstractAsyncFile::process_event>(file_d.descriptor(), events_,
+                                                                                  this)) {
             on_start();
         }
     }
 
     void AbstractAsyncFile::stop() {
         if (file_d.has_valid_descriptor()) {
+            ++session_;
             epoll_.remove(file_d.descriptor());
             on_stop();
             file_d.close();
+            // Buffers of running engine request are released to caller only after it returns
+            if (read_inflight_) {
+                for (auto &op:reads_) cancelled_reads_.push_back(std::move(op));
+                reads_.clear();
+            } else fail_reads(ECANCELED);
+            if (write_inflight_) {
+                for (auto &op:writes_) cancelled_writes_.push_back(std::move(op));
+                writes_.clear();
+            } else fail_writes(ECANCELED);
         }
+        input_.clear();
+        scanned_ = 0;
     }
 
     AbstractAsyncFile::~AbstractAsyncFile() {
+        alive_.reset(); // Ignore engine completions
+        reads_.clear(); // Derived object is already destroyed: do not notify
+        writes_.clear();
+        cancelled_reads_.clear();
+        cancelled_writes_.clear();
         stop();
+        // Workers may still use buffers and post to Epoll
+        std::unique_lock<std::mutex> guard(requests_->lock);
+        requests_->idle.wait(guard, [this]() { return requests_->running == 0; });
+    }
+
+    bool AbstractAsyncFile::async_read(char *buffer, size_t min, size_t max, const Completion &callback) {
+        if (!prepare()) return false;
+        reads_.push_back(ReadOperation{buffer, std::min(min, max), max, 0, std::string(), callback, nullptr});
+        pump_reads();
+        return true;
+    }
+
+    bool AbstractAsyncFile::async_read_until(const std::string &delimiter, const DataCompletion &callback,
+                                             size_t max_size) {
+        if (delimiter.empty() || !prepare()) return false;
+        reads_.push_back(ReadOperation{nullptr, 0, max_size, 0, delimiter, nullptr, callback});
+        pump_reads();
+        return true;
+    }
+
+    bool AbstractAsyncFile::async_write(const char *buffer, size_t size, const Completion &callback) {
+        if (!prepare()) return false;
+        writes_.push_back(WriteOperation{buffer, size, 0, nullptr, callback});
+        pump_writes();
+        return true;
+    }
+
+    bool AbstractAsyncFile::async_write(std::string data, const Completion &callback) {
+        if (!prepare()) return false;
+        auto owned = std::make_shared<std::string>(std::move(data));
+        writes_.push_back(WriteOperation{owned->data(), owned->size(), 0, owned, callback});
+        pump_writes();
+        return true;
+    }
+
+    bool AbstractAsyncFile::prepare() {
+        if (!file_d.has_valid_descriptor()) return false;
+        if (in_paused_) { // Input is wanted again
+            in_paused_ = false;
+            update_events();
+        }
+        if (!nonblocking_) {
+            int flags = fcntl(file_d.descriptor(), F_GETFL);
+            if (flags < 0 || fcntl(file_d.descriptor(), F_SETFL, flags | O_NONBLOCK) < 0) return false;
+            nonblocking_ = true;
+        }
+        return true;
+    }
+
+    void AbstractAsyncFile::pump_reads() {
+        if (reading_ || read_inflight_) return; // Operations requested from completion are processed by outer loop
+        reading_ = true;
+        bool blocked = false;
+        while (!reads_.empty() && !blocked && file_d.has_valid_descriptor()) {
+            ReadOperation &op = reads_.front();
+            ssize_t n = 0;
+            if (op.delimiter.empty()) {
+                if (!input_.empty()) {
+                    size_t part = std::min(input_.size(), op.max - op.done);
+                    memcpy(op.buffer + op.done, input_.data(), part);
+                    input_.erase(input_.begin(), input_.begin() + part);
+                    scanned_ = 0;
+                    op.done += part;
+                }
+                if (engine_ != nullptr && op.done < op.min) {
+                    submit_read(op.buffer + op.done, op.max - op.done);
+                    break;
+                }
+                while (op.done < op.min && (n = read(file_d.descriptor(), op.buffer + op.done, op.max - op.done)) > 0)
+                    op.done += static_cast<size_t>(n);
+                if (op.done >= op.min) {
+                    Completion callback = std::move(op.callback);
+                    size_t done = op.done;
+                    reads_.pop_front();
+                    if (callback) callback(0, done);
+                    continue;
+                }
+            } else {
+                size_t from = scanned_ >= op.delimiter.size() ? scanned_ - op.delimiter.size() + 1 : 0;
+                auto found = std::search(input_.begin() + from, input_.end(), op.delimiter.begin(), op.delimiter.end());
+                scanned_ = input_.size();
+                if (found != input_.end()) {
+                    size_t size = static_cast<size_t>(found - input_.begin()) + op.delimiter.size();
+                    DataCompletion callback = std::move(op.data_callback);
+                    reads_.pop_front();
+                    if (callback) callback(0, input_.data(), size);
+                    if (input_.size() >= size) input_.erase(input_.begin(), input_.begin() + size);
+                    scanned_ = 0;
+                    continue;
+                }
+                if (input_.size() >= op.max) {
+                    DataCompletion callback = std::move(op.data_callback);
+                    reads_.pop_front();
+                    if (callback) callback(EMSGSIZE, nullptr, 0);
+                    continue;
+                }
+                if (engine_ != nullptr) {
+                    submit_read(nullptr, std::min<size_t>(4096, op.max - input_.size()));
+                    break;
+                }
+                size_t used = input_.size();
+                input_.resize(std::min(op.max, used + 4096));
+                n = read(file_d.descriptor(), input_.data() + used, input_.size() - used);
+                input_.resize(used + (n > 0 ? n : 0));
+                if (n > 0) continue;
+            }
+            if (n == 0) fail_reads(EndOfFile);
+            else if (errno == EAGAIN || errno == EWOULDBLOCK) blocked = true;
+            else if (errno != EINTR) fail_reads(errno);
+        }
+        reading_ = false;
+        if (reads_.empty()) notify_data();
+    }
+
+    void AbstractAsyncFile::notify_data() {
+        if (engine_ == nullptr || data_posted_ || end_of_file_) return;
+        data_posted_ = true;
+        std::weak_ptr<char> alive = alive_;
+        epoll_.post([this, alive]() { // Posted to avoid recursion on_data -> read -> on_data
+            if (!alive.lock()) return;
+            data_posted_ = false;
+            if (file_d.has_valid_descriptor() && reads_.empty() && !end_of_file_) on_data();
+        });
+    }
+
+    void AbstractAsyncFile::pump_writes() {
+        if (writing_ || write_inflight_) return;
+        writing_ = true;
+        while (!writes_.empty() && file_d.has_valid_descriptor()) {
+            WriteOperation &op = writes_.front();
+            if (engine_ != nullptr && op.done < op.size) {
+                submit_write();
+                break;
+            }
+            ssize_t n = op.done < op.size ? write(file_d.descriptor(), op.buffer + op.done, op.size - op.done) : 0;
+            if (n >= 0) {
+                op.done += static_cast<size_t>(n);
+                if (op.done >= op.size) {
+                    Completion callback = std::move(op.callback);
+                    size_t done = op.done;
+                    writes_.pop_front();
+                    if (callback) callback(0, done);
+                }
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            } else if (errno != EINTR) {
+                fail_writes(errno);
+            }
+        }
+        bool want_out = !writes_.empty();
+        if (want_out != out_armed_) {
+            out_armed_ = want_out;
+            update_events();
+        }
+        writing_ = false;
+    }
+
+    void AbstractAsyncFile::update_events() {
+        if (engine_ != nullptr || !file_d.has_valid_descriptor()) return;
+        uint32_t events = in_paused_ ? events_ & ~EPOLLIN : events_;
+        epoll_.update(file_d.descriptor(), out_armed_ ? events | EPOLLOUT : events);
+    }
+
+    void AbstractAsyncFile::on_data() {
+        if (engine_ != nullptr || in_paused_) return;
+        in_paused_ = true;
+        update_events();
+    }
+
+    std::shared_ptr<Storage> AbstractAsyncFile::engine_descriptor() {
+        // Own descriptor per request: closing or reusing of file descriptor doesn't affect running request
+        int fd = fcntl(file_d.descriptor(), F_DUPFD_CLOEXEC, 0);
+        return fd >= 0 ? std::make_shared<Storage>(fd, true) : nullptr;
+    }
+
+    std::function<void()> AbstractAsyncFile::engine_finished() {
+        std::shared_ptr<EngineRequests> requests = requests_;
+        {
+            std::lock_guard<std::mutex> guard(requests->lock);
+            ++requests->running;
+        }
+        return [requests]() {
+            std::lock_guard<std::mutex> guard(requests->lock);
+            if (--requests->running == 0) requests->idle.notify_all();
+        };
+    }
+
+    void AbstractAsyncFile::submit_read(char *target, size_t size) {
+        auto fd = engine_descriptor();
+        if (!fd) {
+            fail_reads(errno);
+            return;
+        }
+        read_inflight_ = true;
+        std::shared_ptr<std::vector<char>> scratch;
+        if (target == nullptr) { // Read until: data is appended to input_ on completion
+            scratch = std::make_shared<std::vector<char>>(size);
+            target = scratch->data();
+        }
+        std::weak_ptr<char> alive = alive_;
+        uint64_t session = session_;
+        engine_->read(epoll_, fd->descriptor(), target, size, read_offset_,
+                      [this, alive, scratch, fd, session](int error, size_t done) {
+                          if (!alive.lock()) return;
+                          read_inflight_ = false;
+                          if (session != session_) { // Stopped: request has returned, buffers are free now
+                              std::deque<ReadOperation> cancelled;
+                              cancelled.swap(cancelled_reads_);
+                              for (auto &op:cancelled) {
+                                  if (op.callback) op.callback(ECANCELED, op.done);
+                                  if (op.data_callback) op.data_callback(ECANCELED, nullptr, 0);
+                              }
+                              if (file_d.has_valid_descriptor()) pump_reads(); // New session waited for us
+                              return;
+                          }
+                          if (reads_.empty() || !file_d.has_valid_descriptor()) return;
+                          if (error != 0) {
+                              fail_reads(error);
+                          } else if (done == 0) {
+                              end_of_file_ = true;
+                              fail_reads(EndOfFile);
+                          } else {
+                              read_offset_ += done;
+                              if (scratch) input_.insert(input_.end(), scratch->begin(), scratch->begin() + done);
+                              else reads_.front().done += done;
+                              pump_reads();
+                          }
+                      }, engine_finished());
+    }
+
+    void AbstractAsyncFile::submit_write() {
+        auto fd = engine_descriptor();
+        if (!fd) {
+            fail_writes(errno);
+            return;
+        }
+        write_inflight_ = true;
+        WriteOperation &op = writes_.front();
+        std::weak_ptr<char> alive = alive_;
+        uint64_t session = session_;
+        std::shared_ptr<std::string> owned = op.owned; // Keep data alive even if operation is cancelled
+        engine_->write(epoll_, fd->descriptor(), op.buffer + op.done, op.size - op.done, write_offset_,
+                       [this, alive, owned, fd, session](int error, size_t done) {
+                           if (!alive.lock()) return;
+                           write_inflight_ = false;
+                           if (session != session_) { // Stopped: request has returned, buffers are free now
+                               std::deque<WriteOperation> cancelled;
+                               cancelled.swap(cancelled_writes_);
+                               for (auto &op:cancelled) if (op.callback) op.callback(ECANCELED, op.done);
+                               if (file_d.has_valid_descriptor()) pump_writes();
+                               return;
+                           }
+                           if (writes_.empty() || !file_d.has_valid_descriptor()) return;
+                           if (error != 0) {
+                               fail_writes(error);
+                           } else {
+                               write_offset_ += done;
+                               writes_.front().done += done;
+                           }
+                           pump_writes();
+                       }, engine_finished());
+    }
+
+    void AbstractAsyncFile::fail_reads(int error) {
+        std::deque<ReadOperation> failed;
+        failed.swap(reads_);
+        for (auto &op:failed) {
+            if (op.callback) op.callback(error, op.done);
+            if (op.data_callback) op.data_callback(error, nullptr, 0);
+        }
+    }
+
+    void AbstractAsyncFile::fail_writes(int error) {
+        std::deque<WriteOperation> failed;
+        failed.swap(writes_);
+        for (auto &op:failed) {
+            if (op.callback) op.callback(error, op.done);
+        }
     }
 
     void AbstractAsyncFile::process_event(io::Epoll &ep, uint32_t events, int fd) {
+        bool read_handled = false, write_handled = false;
+        if ((events & EPOLLIN) && !reads_.empty()) {
+            pump_reads();
+            read_handled = true;
+        }
+        if ((events & EPOLLOUT) && !writes_.empty()) {
+            pump_writes();
+            write_handled = true;
+        }
+        if (!file_d.has_valid_descriptor()) return;
         if (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
             on_close();
             ep.remove(fd);
             file_d.close();
+            fail_reads(EndOfFile);
+            fail_writes(EndOfFile);
         } else if (events & EPOLLIN) {
-            on_data();
-        } else {
+            if (!read_handled) on_data();
+        } else if (!write_handled) {
             on_event(events);
         }
     }
-}
\ No newline at end of file
+}
@@ -7,10 +7,18 @@
 
 #include "io.h"
 #include "application.h"
+#include "concurrent.h"
+#include "delegate.h"
+#include "registry.h"
+#include "histogram.h"
+#include "timestamp.h"
 #include <unordered_map>
 #include <functional>
 #include <sys/epoll.h>
 #include <mutex>
+#include <deque>
+#include <condition_variable>
+#include <atomic>
 
 namespace io {
     /**
@@ -18,12 +26,17 @@ namespace io {
      */
     struct Epoll : public Storage, public WithError {
         /**
-         * Callback type.
+         * Callback type. Non-allocating: functors up to 48 bytes (including std::function) are stored inline.
          * - Epoll instance
          * - events
          * - descriptor
          */
-        using Callback = std::function<void(Epoll &, uint32_t, int)>;
+        using Callback = Delegate<void(Epoll &, uint32_t, int)>;
+
+        /**
+         * Task posted from other threads
+         */
+        using Task = std::function<void()>;
 
         /**
          * Move semantic
@@ -40,12 +53,24 @@ namespace io {
          */
         Epoll(size_t cache_size = 100, int flags = 0);
 
+        /**
+         * Close wakeup descriptor. Not executed posted tasks are dropped
+         */
+        ~Epoll();
+
         /**
          * Process events or unblock after `timeout` (in ms).
          * Returns count of processed events or less then 0 on error
          */
         int poll(int timeout = -1);
 
+        /**
+         * Low latency poll: spin with zero timeout for `spin_budget` microseconds and block for `timeout` (in ms)
+         * only if nothing arrived. Burns CPU while spinning.
+         * Returns count of processed events or less then 0 on error
+         */
+        int run_busy(uint64_t spin_budget, int timeout = -1);
+
         /**
          * Add `callback` for descriptor `fd` with events `events_filter`.
          * Return state of operation
@@ -57,8 +82,18 @@ namespace io {
          */
         template<class T, class FunctionMember>
         inline bool add(int fd, uint32_t events_filter, FunctionMember member, T *obj) {
-            return add(fd, events_filter,
-                       std::bind(member, obj, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
+            return add(fd, events_filter, [member, obj](Epoll &epoll, uint32_t events, int descriptor) {
+                (obj->*member)(epoll, events, descriptor);
+            });
+        }
+
+        /**
+         * Add callback for descriptor from class member known at compile time: add<T, &T::method>(fd, events, obj).
+         * Dispatch calls member directly without type erasure of member pointer
+         */
+        template<class T, void (T::*Method)(Epoll &, uint32_t, int)>
+        inline bool add(int fd, uint32_t events_filter, T *obj) {
+            return add(fd, events_filter, Callback::template bind<T, Method>(obj));
         }
 
         /**
@@ -74,7 +109,14 @@ namespace io {
         /**
          * Change callback for desctiptor
          */
-        bool update(int fd, Callback &callback);
+        bool update(int fd, const Callback &callback);
+
+        /**
+         * Execute `task` in thread which polls this instance. Thread safe and lock-free.
+         * Posts made before the loop wakes up are executed in one batch after single eventfd notification.
+         * Returns false if wakeup descriptor is not available
+         */
+        bool post(Task task);
 
         /**
          * Gets size of events cache (count of maximum events per poll)
@@ -95,16 +137,45 @@ namespace io {
 
         std::unordered_map<int, Callback> callbacks_;
 
+        std::unique_ptr<MpscQueue<Task>> tasks_;
+
+        int wakeup_fd_ = -1;
+
+        void run_posted();
     };
 
 
+    /**
+     * Admission control of AsyncSocketServer. Zero values disable limits
+     */
+    struct AdmissionLimits {
+        size_t max_clients = 0;           // Concurrent clients. Listener is paused at limit
+        double accept_rate = 0;           // Accepted clients per second (token bucket)
+        size_t accept_burst = 0;          // Bucket size, 0 - one second of accept_rate
+        bool reserve_descriptor = true;   // Keep spare descriptor to shed clients on EMFILE/ENFILE
+        uint64_t overload_pause = 100;    // Pause of listener after EMFILE/ENFILE/ENOMEM in milliseconds
+    };
+
+    /**
+     * Memory budget of AsyncSocketServer clients: stream and line buffers plus bytes charged by user.
+     * Above limit actions are applied in order while usage stays above it
+     */
+    struct MemoryBudget {
+        size_t limit = 0;              // Bytes for all clients, 0 - accounting only
+        double resume_ratio = 0.8;     // Throttled reading and accepting are resumed below limit * resume_ratio
+        bool shrink_idle = true;       // Release buffers without data
+        bool throttle = true;          // Stop accepting and reading clients without buffered input (partial
+                                       // lines are still completed), kernel buffers push back
+        bool shed_largest = false;     // Disconnect largest consumers
+    };
+
     /**
      * Abstract Epoll based async socket server
      */
     struct AsyncSocketServer {
 
         /**
-         * Stop server, remove from epoll, close all clients and free allocated resources. Collection locked here
+         * Stop server, remove from epoll, close all clients and free allocated resources
          */
         void stop();
 
@@ -118,6 +189,89 @@ namespace io {
          */
         inline io::ConnectionManager::Ptr server() { return server_; }
 
+        /**
+         * Set admission limits. Above limits listener is removed from epoll events and resumed below them,
+         * so backlog of kernel holds new connections instead of user space. Returns false on error
+         */
+        bool set_admission(const AdmissionLimits &limits);
+
+        inline const AdmissionLimits &admission() const { return limits_; }
+
+        /**
+         * Enable memory accounting of clients with `budget`. Accounting is updated after every client event
+         * and adds a lock per event, so it's disabled until first call. Throttled clients are resumed when usage
+         * drops on disconnects or charge(): combine throttling with shedding if usage is not released otherwise
+         */
+        void set_memory_budget(const MemoryBudget &budget);
+
+        inline const MemoryBudget &memory_budget() const { return budget_; }
+
+        /**
+         * Bytes held by all clients and charged by charge()
+         */
+        inline size_t memory_usage() const {
+            int64_t usage = memory_usage_.load(std::memory_order_relaxed); // Release may overtake its charge
+            return usage > 0 ? static_cast<size_t>(usage) : 0;
+        }
+
+        /**
+         * Bytes held by client on last accounting or 0 if client is unknown or accounting is disabled
+         */
+        size_t client_memory_usage(int fd) const;
+
+        /**
+         * Account user state of client: `bytes` is added (or subtracted if negative) to its usage
+         */
+        void charge_client(int fd, int64_t bytes);
+
+        /**
+         * Account memory shared by clients, like queued broadcasts
+         */
+        void charge(int64_t bytes);
+
+        /**
+         * Reading and accepting are stopped by memory budget
+         */
+        inline bool memory_throttled() const { return throttled_; }
+
+        /**
+         * Count of clients disconnected by memory budget
+         */
+        inline uint64_t memory_shed_clients() const { return memory_shed_; }
+
+        /**
+         * Is accepting paused by admission control
+         */
+        inline bool paused() const { return paused_ != 0; }
+
+        /**
+         * Count of clients closed right after accept because descriptors or memory were exhausted
+         */
+        inline uint64_t shed_clients() const { return shed_; }
+
+        /**
+         * Line protocol mode: incoming data is read without blocking into per-client buffer and
+         * on_client_line() is called for every complete line instead of on_client_data_ready().
+         * Clients with line longer then `max_line` bytes are disconnected
+         */
+        void set_line_mode(bool enable, size_t max_line = 65536);
+
+        inline bool line_mode() const { return line_mode_; }
+
+        /**
+         * Kernel timestamping of clients accepted later (SO_TIMESTAMPING). Delay between arrival of data
+         * and on_client_data_ready() or on_client_line() call is counted in receive_latency().
+         * With `transmit` transmit timestamps are drained on EPOLLERR and passed to on_client_transmitted()
+         */
+        void set_timestamping(bool enable, bool transmit = false);
+
+        inline bool timestamping() const { return timestamping_; }
+
+        /**
+         * Nanoseconds from packet arrival to callback invocation
+         */
+        inline io::LatencyHistogram &receive_latency() { return receive_latency_; }
+
         /**
          * Stop server
          */
@@ -131,14 +285,9 @@ namespace io {
 
 
         /**
-         * Collection of clients sockets
-         */
-        std::unordered_map<int, io::FileStream::Ptr> clients_;
-
-        /**
-         * Lock collection for access from other threads
+         * Collection of clients sockets. Lookups are lock-free, use snapshot() for iteration
          */
-        std::unique_lock<std::mutex> lock_collection();
+        io::ClientRegistry clients_;
 
         /**
          * Calls when server started and running
@@ -171,25 +320,104 @@ namespace io {
         virtual void on_client_data_ready(io::FileStream::Ptr client) { }
 
         /**
-         * Find client socket by descriptor or return null. Thread safe
+         * Calls in line mode for each complete line without \n or \r\n. Data is valid only inside call.
+         * Unterminated tail is passed when client disconnects
+         */
+        virtual void on_client_line(io::FileStream::Ptr client, const char *line, size_t size) { }
+
+        /**
+         * Calls in line mode when line exceeds limit, client is disconnected after it
+         */
+        virtual void on_client_line_too_long(io::FileStream::Ptr client) { }
+
+        /**
+         * Calls with transmit timestamps of client when timestamping with transmit is enabled
+         */
+        virtual void on_client_transmitted(io::FileStream::Ptr client,
+                                           const std::vector<io::TransmitTimestamp> &stamps) { }
+
+        /**
+         * Kernel arrival time of oldest data in current on_client_data_ready() or on_client_line() call,
+         * see timestamp_now(). 0 if timestamping is disabled or not available
+         */
+        static uint64_t received_at() { return received_at_; }
+
+        /**
+         * Epoll instance of server
+         */
+        inline io::Epoll &poller() { return poller_; }
+
+        /**
+         * Find client socket by descriptor or return null. Thread safe and lock-free
          */
         inline io::FileStream::Ptr find_client_by_descriptor(int fd) const {
-            std::lock_guard<std::mutex> guard(lock_);
-            auto client = clients_.find(fd);
-            if (client == clients_.end())return nullptr;
-            return (*client).second;
+            return clients_.find(fd);
         }
 
     private:
-        /**
-         * Collection lock
-         */
-        mutable std::mutex lock_;
+        enum Pause : uint32_t {
+            Capacity = 1,   // max_clients reached
+            Rate = 2,       // No accept tokens
+            Overload = 4,   // EMFILE/ENFILE/ENOMEM
+            Memory = 8      // Memory budget exceeded
+        };
+
+        struct ClientMemory {
+            std::mutex lock;                   // Held while client is handled: reclaiming skips busy clients
+            std::atomic<size_t> accounted{0};  // Buffers, part of memory_usage_. Changed under lock
+            int64_t charged = 0;               // By user, guarded by memory_lock_
+            bool closed = false;
+            std::mutex interest;               // Guards `paused` and epoll events of client
+            bool paused = false;               // EPOLLIN is removed by throttling
+        };
 
         void on_server_event(io::Epoll &, uint32_t events, int fd); //Thread safe
 
         void on_client_event(io::Epoll &, uint32_t events, int client_fd);//Thread safe
 
+        struct LineBuffer {
+            std::mutex lock; // Level-triggered EPOLLIN of one client can wake several threads
+            std::vector<char> data;
+            size_t size = 0, scanned = 0; // Received and checked for EOL bytes
+        };
+
+        void on_resume_timer(io::Epoll &, uint32_t events, int fd);
+
+        bool read_lines(const io::FileStream::Ptr &client, int client_fd);
+
+        void disconnect(const io::FileStream::Ptr &client, int client_fd);
+
+        std::shared_ptr<ClientMemory> client_memory(int client_fd) const;
+
+        void account(const io::FileStream::Ptr &client, int client_fd, ClientMemory &memory);
+
+        size_t shrink(const io::FileStream::Ptr &client, int client_fd, bool output);
+
+        void enforce_budget();
+
+        void throttle(bool enable);
+
+        bool holds_input(const io::FileStream::Ptr &client, int client_fd);
+
+        void set_reading(int client_fd, ClientMemory &memory, bool enable);
+
+        void on_budget_timer(io::Epoll &, uint32_t events, int fd);
+
+        uint32_t take_timestamps(const io::FileStream::Ptr &client, int client_fd, uint32_t events);
+
+        bool admit();
+
+        void shed();
+
+        void pause(uint32_t reason, uint64_t delay_ns = 0);
+
+        void resume(uint32_t reason);
+
+        /**
+         * Arm timer for nearest resume deadline of timed pauses or disarm it
+         */
+        void arm_resume_timer();
+
         io::Epoll &poller_;
 
         io::ConnectionManager::Ptr server_;
@@ -197,19 +425,117 @@ namespace io {
         int server_fd_ = -1;
 
         bool running_ = false;
+
+        AdmissionLimits limits_;
+
+        uint32_t paused_ = 0;
+
+        double tokens_ = 0;
+
+        uint64_t refilled_at_ = 0; // Monotonic nanoseconds
+
+        uint64_t rate_until_ = 0, overload_until_ = 0; // Resume deadlines of timed pauses, 0 - not paused
+
+        int timer_fd_ = -1, reserve_fd_ = -1;
+
+        uint64_t shed_ = 0;
+
+        bool line_mode_ = false;
+
+        size_t max_line_ = 65536;
+
+        std::mutex lines_lock_; // Guards map only, buffers have own locks
+
+        std::unordered_map<int, std::shared_ptr<LineBuffer>> lines_;
+
+        bool timestamping_ = false, transmit_timestamps_ = false;
+
+        io::LatencyHistogram receive_latency_;
+
+        static thread_local uint64_t received_at_;
+
+        bool accounting_ = false;
+
+        MemoryBudget budget_;
+
+        std::atomic<int64_t> memory_usage_{0};
+
+        mutable std::mutex memory_lock_; // Guards map only
+
+        std::unordered_map<int, std::shared_ptr<ClientMemory>> memory_;
+
+        std::mutex reclaim_lock_;
+
+        std::atomic<bool> throttled_{false};
+
+        int budget_timer_fd_ = -1; // Periodic budget check while throttled
+
+        uint64_t memory_shed_ = 0, reclaimed_at_ = 0;
     };
 
 
+    struct FileEngine;
+
     /**
-     * Universal IO interface for Epoll events: IN/ERR/HUP/RDHUP
+     * Universal IO interface for Epoll events: IN/ERR/HUP/RDHUP.
+     * Regular files can't be watched by epoll: their async operations are executed by FileEngine::shared(),
+     * on_data() is called after start and after reads complete while file is not read to the end.
      */
     struct AbstractAsyncFile {
+        enum : int {
+            EndOfFile = -1 // Error code in completion when file closed before operation done
+        };
+
+        /**
+         * Completion of async read/write.
+         * - error code: 0 on success, errno or EndOfFile
+         * - count of transferred bytes
+         */
+        using Completion = std::function<void(int, size_t)>;
+
+        /**
+         * Completion of async_read_until.
+         * - error code: 0 on success, errno or EndOfFile
+         * - pointer to data with delimiter in internal buffer. Valid only inside callback
+         * - size of data with delimiter
+         */
+        using DataCompletion = std::function<void(int, const char *, size_t)>;
 
         /**
          * Get underlying file stream
          */
         inline io::Storage &file() { return file_d; }
 
+        /**
+         * Read at least `min` and at most `max` bytes to caller-owned `buffer`, which must stay valid
+         * until completion. Operations are completed in order of requests, possibly immediately.
+         * Returns false if file is not active
+         */
+        bool async_read(char *buffer, size_t min, size_t max, const Completion &callback);
+
+        /**
+         * Read until `delimiter` (included) into internal buffer. Fails with EMSGSIZE
+         * if delimiter not found in `max_size` bytes. Returns false if file is not active
+         */
+        bool async_read_until(const std::string &delimiter, const DataCompletion &callback,
+                              size_t max_size = 65536);
+
+        /**
+         * Write caller-owned `buffer`, which must stay valid until completion.
+         * Returns false if file is not active
+         */
+        bool async_write(const char *buffer, size_t size, const Completion &callback);
+
+        /**
+         * Write `data` owned by operation. Returns false if file is not active
+         */
+        bool async_write(std::string data, const Completion &callback);
+
+        /**
+         * Count of not completed read and write operations
+         */
+        inline size_t pending_operations() const { return reads_.size() + writes_.size(); }
+
         /**
          * Close file
          */
@@ -227,9 +553,10 @@ namespace io {
         AbstractAsyncFile(io::Storage &storage, io::Epoll &epoll, uint32_t custom_events = 0);
 
         /**
-         * When EPOLLIN events
+         * When EPOLLIN events and no pending async reads. Default implementation stops watching input
+         * until next async_read, otherwise level-triggered EPOLLIN would repeat forever
          */
-        virtual void on_data() { }
+        virtual void on_data();
 
         /**
          * On HUP, RDHUP, ERR. Closes stream after it.
@@ -252,11 +579,85 @@ namespace io {
         virtual void on_event(uint32_t events) { }
 
     private:
+        struct ReadOperation {
+            char *buffer;
+            size_t min, max, done; // For read until `max` is limit of data size
+            std::string delimiter;
+            Completion callback;
+            DataCompletion data_callback;
+        };
+
+        struct WriteOperation {
+            const char *buffer;
+            size_t size, done;
+            std::shared_ptr<std::string> owned;
+            Completion callback;
+        };
+
         io::Storage &file_d;
 
         Epoll &epoll_;
 
+        uint32_t events_;
+
+        bool nonblocking_ = false, reading_ = false, writing_ = false, out_armed_ = false, in_paused_ = false;
+
+        FileEngine *engine_ = nullptr; // For regular files
+
+        bool read_inflight_ = false, write_inflight_ = false, data_posted_ = false, end_of_file_ = false;
+
+        off_t read_offset_ = 0, write_offset_ = 0;
+
+        std::shared_ptr<char> alive_ = std::make_shared<char>(0); // Guards engine completions
+
+        struct EngineRequests { // Shared with workers: requests not returned yet
+            std::mutex lock;
+            std::condition_variable idle;
+            size_t running = 0;
+        };
+
+        std::shared_ptr<EngineRequests> requests_ = std::make_shared<EngineRequests>();
+
+        uint64_t session_ = 0; // Incremented by stop(): completions of previous sessions are ignored
+
+        std::deque<ReadOperation> reads_;
+
+        std::deque<WriteOperation> writes_;
+
+        std::deque<ReadOperation> cancelled_reads_; // Stopped while engine request runs: failed when it returns
+
+        std::deque<WriteOperation> cancelled_writes_;
+
+        std::vector<char> input_; // Received but not consumed data
+
+        size_t scanned_ = 0; // Bytes of input_ already checked for delimiter
+
         void process_event(io::Epoll &ep, uint32_t events, int fd);
+
+        bool prepare();
+
+        void pump_reads();
+
+        void pump_writes();
+
+        void submit_read(char *target, size_t size);
+
+        void submit_write();
+
+        void notify_data();
+
+        void fail_reads(int error);
+
+        /**
+         * Apply EPOLLIN pause and EPOLLOUT arming to Epoll registration
+         */
+        void update_events();
+
+        void fail_writes(int error);
+
+        std::shared_ptr<Storage> engine_descriptor();
+
+        std::function<void()> engine_finished();
     };
 }
 
@@ -0,0 +1,198 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+#include "codec.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <poll.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace io {
+    /**
+     * Wait until non-blocking `fd` accepts more data. Returns false on poll failure
+     */
+    static bool wait_writable(int fd) {
+        pollfd item = {fd, POLLOUT, 0};
+        while (poll(&item, 1, -1) < 0)
+            if (errno != EINTR) return false;
+        return true; // Error or hangup is reported by following write
+    }
+
+    MessageWriter::MessageWriter(FileStream &stream, LengthPrefix prefix) : stream_(&stream),
+                                                                           descriptor_(stream.descriptor()),
+                                                                           prefix_(prefix) { }
+
+    MessageWriter::MessageWriter(int fd, LengthPrefix prefix) : descriptor_(fd), prefix_(prefix) { }
+
+    size_t MessageWriter::encode_length(LengthPrefix prefix, uint64_t length, uint8_t *header) {
+        if (prefix == LengthPrefix::Fixed32) {
+            header[0] = static_cast<uint8_t>(length >> 24);
+            header[1] = static_cast<uint8_t>(length >> 16);
+            header[2] = static_cast<uint8_t>(length >> 8);
+            header[3] = static_cast<uint8_t>(length);
+            return 4;
+        }
+        size_t size = 0;
+        do {
+            uint8_t byte = static_cast<uint8_t>(length & 0x7F);
+            length >>= 7;
+            header[size++] = length ? static_cast<uint8_t>(byte | 0x80) : byte;
+        } while (length);
+        return size;
+    }
+
+    bool MessageWriter::send(const void *data, size_t size) {
+        if (descriptor_ < 0) return false;
+        if (prefix_ == LengthPrefix::Fixed32 && size > UINT32_MAX) {
+            set_error(EMSGSIZE, "Message too large for 32 bit prefix");
+            return false;
+        }
+        while (stream_ != nullptr && !stream_->output().flush()) {
+            if (!stream_->output_would_block() || !wait_writable(descriptor_)) {
+                set_error(EIO, "Failed to flush stream");
+                return false;
+            }
+            stream_->rearm();
+        }
+        uint8_t header[10];
+        iovec parts[2];
+        parts[0].iov_base = header;
+        parts[0].iov_len = encode_length(prefix_, size, header);
+        parts[1].iov_base = const_cast<void *>(data);
+        parts[1].iov_len = size;
+        iovec *iov = parts;
+        int count = size > 0 ? 2 : 1;
+        while (count > 0) {
+            ssize_t n = writev(descriptor_, iov, count);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                // Part of frame may be sent already: finish it, or framing of peer is broken
+                if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_writable(descriptor_)) continue;
+                set_error();
+                return false;
+            }
+            size_t written = static_cast<size_t>(n);
+            while (count > 0 && written >= iov->iov_len) { // Skip completed parts
+                written -= iov->iov_len;
+                ++iov;
+                --count;
+            }
+            if (count > 0) {
+                iov->iov_base = static_cast<char *>(iov->iov_base) + written;
+                iov->iov_len -= written;
+            }
+        }
+        return true;
+    }
+
+    MessageReader::MessageReader(int fd, LengthPrefix prefix, size_t buffer_size, size_t max_frame) :
+            descriptor_(fd), prefix_(prefix), max_frame_(max_frame), buffer_(buffer_size < 16 ? 16 : buffer_size) { }
+
+    int MessageReader::decode_length(LengthPrefix prefix, const char *data, size_t size, uint64_t &length) {
+        const uint8_t *bytes = reinterpret_cast<const uint8_t *>(data);
+        if (prefix == LengthPrefix::Fixed32) {
+            if (size < 4) return 0;
+            length = (static_cast<uint64_t>(bytes[0]) << 24) | (static_cast<uint64_t>(bytes[1]) << 16) |
+                     (static_cast<uint64_t>(bytes[2]) << 8) | static_cast<uint64_t>(bytes[3]);
+            return 4;
+        }
+        length = 0;
+        for (size_t i = 0; i < size; ++i) {
+            if (i >= 10) return -1;
+            length |= static_cast<uint64_t>(bytes[i] & 0x7F) << (7 * i);
+            if ((bytes[i] & 0x80) == 0) return static_cast<int>(i + 1);
+        }
+        return size >= 10 ? -1 : 0;
+    }
+
+    int MessageReader::read_some(const Handler &handler) {
+        if (descriptor_ < 0) return -1;
+        if (end_ == buffer_.size() && begin_ > 0) {
+            std::memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+            end_ -= begin_;
+            begin_ = 0;
+        }
+        bool direct = !large_.empty() && begin_ == end_; // Large frame body goes straight to its storage
+        ssize_t n = direct ? read(descriptor_, large_.data() + large_done_, large_.size() - large_done_)
+                           : read(descriptor_, buffer_.data() + end_, buffer_.size() - end_);
+        if (n == 0) return -1;
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+            set_error();
+            return -1;
+        }
+        if (direct) large_done_ += static_cast<size_t>(n);
+        else end_ += static_cast<size_t>(n);
+        return parse(handler);
+    }
+
+    int MessageReader::feed(const char *data, size_t size, const Handler &handler) {
+        int total = 0;
+        while (size > 0) {
+            if (end_ == buffer_.size() && begin_ > 0) {
+                std::memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+                end_ -= begin_;
+                begin_ = 0;
+            }
+            size_t part = std::min(size, buffer_.size() - end_);
+            std::memcpy(buffer_.data() + end_, data, part);
+            end_ += part;
+            data += part;
+            size -= part;
+            int count = parse(handler);
+            if (count < 0) return -1;
+            total += count;
+        }
+        return total;
+    }
+
+    int MessageReader::parse(const Handler &handler) {
+        int count = 0;
+        while (true) {
+            if (!large_.empty()) { // Continue frame which doesn't fit buffer
+                size_t part = std::min(end_ - begin_, large_.size() - large_done_);
+                std::memcpy(large_.data() + large_done_, buffer_.data() + begin_, part);
+                begin_ += part;
+                large_done_ += part;
+                if (large_done_ < large_.size()) break;
+                handler(large_.data(), large_.size());
+                std::vector<char>().swap(large_);
+                large_done_ = 0;
+                ++count;
+                continue;
+            }
+            uint64_t length = 0;
+            int header = decode_length(prefix_, buffer_.data() + begin_, end_ - begin_, length);
+            if (header < 0) {
+                set_error(MalformedLength, "Malformed length prefix");
+                return -1;
+            }
+            if (header == 0) break;
+            if (length > max_frame_) {
+                set_error(FrameTooLarge, "Frame exceeds maximum size");
+                return -1;
+            }
+            if (header + length > buffer_.size()) {
+                begin_ += header;
+                large_.resize(length);
+                large_done_ = 0;
+                continue;
+            }
+            if (end_ - begin_ < header + length) break;
+            handler(buffer_.data() + begin_ + header, length);
+            begin_ += header + length;
+            ++count;
+        }
+        if (begin_ == end_) {
+            begin_ = end_ = 0;
+        } else if (begin_ > 0) { // Keep partial frame at start so it can be completed in place
+            std::memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+            end_ -= begin_;
+            begin_ = 0;
+        }
+        return count;
+    }
+}
@@ -0,0 +1,109 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+#ifndef IO_CODEC_H
+#define IO_CODEC_H
+
+#include "io.h"
+#include <functional>
+
+namespace io {
+
+    /**
+     * Length prefix format of binary messages
+     */
+    enum class LengthPrefix {
+        Varint,  // LEB128 (7 bits per byte), 1-10 bytes
+        Fixed32  // 4 bytes, big endian
+    };
+
+    /**
+     * Writes length prefixed messages. Header and payload are sent by single gather write.
+     */
+    struct MessageWriter : public WithError {
+
+        /**
+         * Writer bound to stream. Buffered stream output is flushed before each message to keep order
+         */
+        explicit MessageWriter(FileStream &stream, LengthPrefix prefix = LengthPrefix::Varint);
+
+        /**
+         * Writer bound to raw descriptor
+         */
+        explicit MessageWriter(int fd, LengthPrefix prefix = LengthPrefix::Varint);
+
+        /**
+         * Send one message. Blocks until all bytes written, on non-blocking descriptor too (waits for POLLOUT
+         * instead of leaving part of frame sent). Returns false on error
+         */
+        bool send(const void *data, size_t size);
+
+        inline bool send(const std::string &message) { return send(message.data(), message.size()); }
+
+        /**
+         * Encode length prefix to `header` (at least 10 bytes). Returns size of prefix
+         */
+        static size_t encode_length(LengthPrefix prefix, uint64_t length, uint8_t *header);
+
+    private:
+        FileStream *stream_ = nullptr;
+        int descriptor_;
+        LengthPrefix prefix_;
+    };
+
+    /**
+     * Reassembles length prefixed messages in internal read buffer. Messages which fit the buffer are
+     * delivered in place without copy, only larger frames are allocated separately.
+     * Do not mix with input() of the same FileStream: data already buffered by istream is not visible here.
+     */
+    struct MessageReader : public WithError {
+        enum ErrCodes : int {
+            FrameTooLarge = -1,
+            MalformedLength = -2
+        };
+
+        /**
+         * Message handler. Data is valid only inside handler
+         */
+        using Handler = std::function<void(const char *, size_t)>;
+
+        /**
+         * Reader of descriptor `fd` with buffer `buffer_size` bytes and maximum frame size `max_frame`
+         */
+        explicit MessageReader(int fd, LengthPrefix prefix = LengthPrefix::Varint, size_t buffer_size = 65536,
+                               size_t max_frame = 16 * 1024 * 1024);
+
+        /**
+         * Read available data (single `read` call) and call `handler` for each complete message.
+         * Returns count of delivered messages, 0 on would-block or -1 on EOF or error (check has_error)
+         */
+        int read_some(const Handler &handler);
+
+        /**
+         * Feed bytes received outside of reader. Returns count of delivered messages or -1 on error
+         */
+        int feed(const char *data, size_t size, const Handler &handler);
+
+        inline size_t max_frame() const { return max_frame_; }
+
+        inline void set_max_frame(size_t max_frame) { max_frame_ = max_frame; }
+
+        /**
+         * Decode length prefix. Returns size of prefix, 0 if incomplete or -1 if malformed
+         */
+        static int decode_length(LengthPrefix prefix, const char *data, size_t size, uint64_t &length);
+
+    private:
+        int parse(const Handler &handler);
+
+        int descriptor_;
+        LengthPrefix prefix_;
+        size_t max_frame_;
+        std::vector<char> buffer_;
+        size_t begin_ = 0, end_ = 0; // Not parsed data
+        std::vector<char> large_;    // Frame larger than buffer
+        size_t large_done_ = 0;
+    };
+}
+#endif //IO_CODEC_H
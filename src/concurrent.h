@@ -7,6 +7,7 @@
 
 #include <mutex>
 #include <queue>
+#include <atomic>
 #include <condition_variable>
 
 namespace io {
@@ -95,6 +96,74 @@ namespace io {
     };
 
 
+/**
+ * Lock-free multi-producer single-consumer queue. Producers push with single CAS,
+ * consumer takes all pending items at once in FIFO order
+ */
+    template<class T>
+    class MpscQueue {
+        struct Node {
+            T value;
+            Node *next;
+        };
+
+    public:
+        MpscQueue() : head_(nullptr) { }
+
+        /**
+         * Push item to queue. Thread safe. Returns true if queue was empty before
+         */
+        inline bool push(T value) {
+            Node *node = new Node{std::move(value), nullptr};
+            Node *head = head_.load(std::memory_order_relaxed);
+            do {
+                node->next = head;
+            } while (!head_.compare_exchange_weak(head, node, std::memory_order_release, std::memory_order_relaxed));
+            return head == nullptr;
+        }
+
+        /**
+         * Take all pushed items and call `fn` for each of them. Only one thread can consume.
+         * Returns count of processed items
+         */
+        template<class Fn>
+        inline size_t drain(Fn fn) {
+            Node *list = head_.exchange(nullptr, std::memory_order_acquire);
+            Node *ordered = nullptr;
+            while (list != nullptr) { // Stack to FIFO
+                Node *next = list->next;
+                list->next = ordered;
+                ordered = list;
+                list = next;
+            }
+            size_t count = 0;
+            while (ordered != nullptr) {
+                Node *next = ordered->next;
+                fn(ordered->value);
+                delete ordered;
+                ordered = next;
+                ++count;
+            }
+            return count;
+        }
+
+        inline bool empty() const { return head_.load(std::memory_order_acquire) == nullptr; }
+
+        /**
+         * Drop not consumed items
+         */
+        ~MpscQueue() {
+            drain([](T &) { });
+        }
+
+    private:
+        MpscQueue(const MpscQueue &) = delete;
+
+        MpscQueue &operator=(const MpscQueue &) = delete;
+
+        std::atomic<Node *> head_;
+    };
+
 /**
  * Call something on destroy. For example thread::join
  */
@@ -0,0 +1,147 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+#ifndef IO_DELEGATE_H
+#define IO_DELEGATE_H
+
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace io {
+
+    template<class Signature, size_t Size = 48>
+    class Delegate;
+
+    /**
+     * Non-allocating replacement of std::function. Functors up to `Size` bytes are stored inline,
+     * larger functors are rejected at compile time. Member functions bound by bind<T, &T::method>(obj)
+     * are called directly from generated trampoline.
+     */
+    template<class R, class... Args, size_t Size>
+    class Delegate<R(Args...), Size> {
+    public:
+        Delegate() noexcept { }
+
+        Delegate(std::nullptr_t) noexcept { }
+
+        /**
+         * Store copy of `functor` inline
+         */
+        template<class F, class Fn = typename std::decay<F>::type,
+                class = typename std::enable_if<!std::is_same<Fn, Delegate>::value>::type>
+        Delegate(F &&functor) {
+            static_assert(sizeof(Fn) <= Size, "Functor is too large for inline storage of Delegate");
+            static_assert(alignof(Fn) <= alignof(Storage), "Functor alignment is not supported by Delegate");
+            new(&storage_) Fn(std::forward<F>(functor));
+            invoke_ = &invoke_functor<Fn>;
+            manage_ = std::is_trivially_copyable<Fn>::value ? nullptr : &manage_functor<Fn>;
+        }
+
+        /**
+         * Delegate to member function `Method` of `object`
+         */
+        template<class T, R (T::*Method)(Args...)>
+        static Delegate bind(T *object) {
+            Delegate delegate;
+            new(&delegate.storage_) T *(object);
+            delegate.invoke_ = &invoke_method<T, Method>;
+            return delegate;
+        }
+
+        Delegate(const Delegate &that) : invoke_(that.invoke_), manage_(that.manage_) {
+            if (manage_) manage_(Copy, &storage_, const_cast<Storage *>(&that.storage_));
+            else std::memcpy(&storage_, &that.storage_, sizeof(storage_));
+        }
+
+        Delegate(Delegate &&that) noexcept : invoke_(that.invoke_), manage_(that.manage_) {
+            if (manage_) manage_(Move, &storage_, &that.storage_);
+            else std::memcpy(&storage_, &that.storage_, sizeof(storage_));
+            that.invoke_ = nullptr;
+            that.manage_ = nullptr;
+        }
+
+        Delegate &operator=(const Delegate &that) {
+            if (this != &that) {
+                Delegate copy(that);
+                *this = std::move(copy);
+            }
+            return *this;
+        }
+
+        Delegate &operator=(Delegate &&that) noexcept {
+            if (this != &that) {
+                reset();
+                invoke_ = that.invoke_;
+                manage_ = that.manage_;
+                if (manage_) manage_(Move, &storage_, &that.storage_);
+                else std::memcpy(&storage_, &that.storage_, sizeof(storage_));
+                that.invoke_ = nullptr;
+                that.manage_ = nullptr;
+            }
+            return *this;
+        }
+
+        ~Delegate() { reset(); }
+
+        /**
+         * Destroy stored functor
+         */
+        inline void reset() noexcept {
+            if (manage_) manage_(Destroy, &storage_, nullptr);
+            invoke_ = nullptr;
+            manage_ = nullptr;
+        }
+
+        inline explicit operator bool() const noexcept { return invoke_ != nullptr; }
+
+        inline R operator()(Args... args) const {
+            return invoke_(const_cast<Storage *>(&storage_), std::forward<Args>(args)...);
+        }
+
+    private:
+        enum Operation {
+            Copy, Move, Destroy
+        };
+
+        using Storage = typename std::aligned_storage<Size, alignof(std::max_align_t)>::type;
+
+        using Invoker = R (*)(void *, Args...);
+
+        using Manager = void (*)(Operation, void *, void *);
+
+        template<class Fn>
+        static R invoke_functor(void *storage, Args... args) {
+            return (*static_cast<Fn *>(storage))(std::forward<Args>(args)...);
+        }
+
+        template<class T, R (T::*Method)(Args...)>
+        static R invoke_method(void *storage, Args... args) {
+            return ((*static_cast<T **>(storage))->*Method)(std::forward<Args>(args)...);
+        }
+
+        template<class Fn>
+        static void manage_functor(Operation operation, void *destination, void *source) {
+            switch (operation) {
+                case Copy:
+                    new(destination) Fn(*static_cast<const Fn *>(source));
+                    break;
+                case Move:
+                    new(destination) Fn(std::move(*static_cast<Fn *>(source)));
+                    static_cast<Fn *>(source)->~Fn();
+                    break;
+                case Destroy:
+                    static_cast<Fn *>(destination)->~Fn();
+                    break;
+            }
+        }
+
+        Storage storage_;
+        Invoker invoke_ = nullptr;
+        Manager manage_ = nullptr; // Null for trivially copyable content
+    };
+}
+#endif //IO_DELEGATE_H
@@ -0,0 +1,138 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+#include "direct.h"
+#include <cstdlib>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace io {
+
+    static inline size_t round_up(size_t value, size_t block) { return (value + block - 1) / block * block; }
+
+    size_t logical_block_size(int fd) {
+        struct stat info;
+        size_t block = 0;
+        if (fstat(fd, &info) == 0) {
+            if (S_ISBLK(info.st_mode)) {
+                int sector = 0;
+                if (ioctl(fd, BLKSSZGET, &sector) == 0 && sector > 0) block = static_cast<size_t>(sector);
+            } else if (info.st_blksize > 0) {
+                block = static_cast<size_t>(info.st_blksize);
+            }
+        }
+        if (block < 512 || (block & (block - 1)) != 0) block = 4096;
+        return block;
+    }
+
+    int open_direct(const std::string &path, int flags, mode_t mode, bool fallback) {
+        int fd = ::open(path.c_str(), flags | O_DIRECT | O_CLOEXEC, mode);
+        if (fd < 0 && errno == EINVAL && fallback) fd = ::open(path.c_str(), flags | O_CLOEXEC, mode);
+        return fd;
+    }
+
+    AlignedBuffer::AlignedBuffer(size_t size, size_t alignment) {
+        void *memory = nullptr;
+        if (posix_memalign(&memory, alignment, size) == 0) {
+            data_ = static_cast<char *>(memory);
+            size_ = size;
+        }
+    }
+
+    AlignedBuffer::~AlignedBuffer() { free(data_); }
+
+    DirectReadBuffer::DirectReadBuffer(int d, std::size_t chunk_size)
+            : block_(logical_block_size(d)),
+              buffer_(round_up(chunk_size > 0 ? chunk_size : 1, logical_block_size(d)), logical_block_size(d)) {
+        descriptor_ = d;
+        offset_ = lseek(d, 0, SEEK_CUR);
+        if (offset_ < 0) offset_ = 0;
+    }
+
+    std::streambuf::int_type DirectReadBuffer::underflow() {
+        if (gptr() < egptr())  // buffer not exhausted
+            return traits_type::to_int_type(*gptr());
+        if (!has_valid_descriptor() || buffer_.data() == nullptr) return traits_type::eof();
+        off_t aligned = offset_ - offset_ % static_cast<off_t>(block_); // Unaligned start or tail after short read
+        size_t skip = static_cast<size_t>(offset_ - aligned);
+        ssize_t n;
+        do {
+            n = pread(descriptor_, buffer_.data(), buffer_.size(), aligned);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0 || static_cast<size_t>(n) <= skip) return traits_type::eof();
+        char *base = buffer_.data();
+        setg(base, base + skip, base + n);
+        offset_ = aligned + n;
+        return traits_type::to_int_type(*gptr());
+    }
+
+    DirectWriteBuffer::DirectWriteBuffer(int d, std::size_t chunk_size)
+            : block_(logical_block_size(d)),
+              buffer_(round_up(chunk_size > 0 ? chunk_size : 1, logical_block_size(d)), logical_block_size(d)) {
+        descriptor_ = d;
+        offset_ = lseek(d, 0, SEEK_CUR);
+        if (offset_ < 0) offset_ = 0;
+        if (offset_ % static_cast<off_t>(block_) != 0) { // Direct IO requires aligned file offset
+            int flags = fcntl(d, F_GETFL);
+            if (flags >= 0) fcntl(d, F_SETFL, flags & ~O_DIRECT);
+        }
+        if (buffer_.data() != nullptr) setp(buffer_.data(), buffer_.data() + buffer_.size());
+    }
+
+    DirectWriteBuffer::~DirectWriteBuffer() { finish(); }
+
+    std::streambuf::int_type DirectWriteBuffer::overflow(std::streambuf::int_type ch) {
+        if (!has_valid_descriptor() || failed_ || pbase() == nullptr) return traits_type::eof();
+        if (!write_blocks(false)) return traits_type::eof();
+        if (ch == traits_type::eof()) return traits_type::not_eof(ch);
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+        return ch;
+    }
+
+    int DirectWriteBuffer::sync() {
+        return write_blocks(false) ? 0 : -1;
+    }
+
+    bool DirectWriteBuffer::finish() {
+        if (!has_valid_descriptor() || pbase() == nullptr) return false;
+        if (!write_blocks(true)) return false;
+        lseek(descriptor_, offset_, SEEK_SET);
+        return true;
+    }
+
+    bool DirectWriteBuffer::write_blocks(bool tail) {
+        if (failed_) return false;
+        size_t pending = static_cast<size_t>(pptr() - pbase());
+        bool direct = offset_ % static_cast<off_t>(block_) == 0;
+        size_t aligned = direct ? pending - pending % block_ : 0;
+        size_t total = tail || !direct ? pending : aligned;
+        size_t done = 0;
+        int flags = -1;
+        while (done < total) {
+            if (done == aligned && flags < 0) { // Unaligned tail is written without O_DIRECT
+                flags = fcntl(descriptor_, F_GETFL);
+                if (flags >= 0 && (flags & O_DIRECT)) fcntl(descriptor_, F_SETFL, flags & ~O_DIRECT);
+            }
+            size_t part = (done < aligned ? aligned : total) - done;
+            ssize_t n = pwrite(descriptor_, pbase() + done, part, offset_ + static_cast<off_t>(done));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                failed_ = true;
+                break;
+            }
+            done += static_cast<size_t>(n);
+        }
+        if (flags >= 0 && (flags & O_DIRECT)) fcntl(descriptor_, F_SETFL, flags);
+        offset_ += static_cast<off_t>(done);
+        size_t rest = pending - done;
+        if (rest > 0 && done > 0) memmove(pbase(), pbase() + done, rest);
+        setp(buffer_.data(), buffer_.data() + buffer_.size());
+        pbump(static_cast<int>(rest));
+        return !failed_;
+    }
+}
@@ -0,0 +1,117 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+#ifndef IO_DIRECT_H
+#define IO_DIRECT_H
+
+#include "io.h"
+#include <sys/types.h>
+
+namespace io {
+
+    /**
+     * Logical block size for direct IO of descriptor: sector size for block devices and
+     * preferred IO block of file system for regular files (at least 512)
+     */
+    size_t logical_block_size(int fd);
+
+    /**
+     * Open file with O_DIRECT. If file system doesn't support direct IO and `fallback` is set,
+     * file is opened in buffered mode. Returns descriptor or -1
+     */
+    int open_direct(const std::string &path, int flags, mode_t mode = 0644, bool fallback = true);
+
+    /**
+     * Memory block aligned to `alignment` (power of 2) suitable for direct IO
+     */
+    struct AlignedBuffer {
+        AlignedBuffer(size_t size, size_t alignment);
+
+        ~AlignedBuffer();
+
+        inline char *data() { return data_; }
+
+        inline size_t size() const { return size_; }
+
+    private:
+        AlignedBuffer(const AlignedBuffer &) = delete;
+
+        AlignedBuffer &operator=(const AlignedBuffer &) = delete;
+
+        char *data_ = nullptr;
+        size_t size_ = 0;
+    };
+
+    /**
+     * Reader for descriptors opened with O_DIRECT (works for buffered descriptors too).
+     * Reads by pread from block aligned offsets into aligned buffer, so page cache is bypassed.
+     * Starts at current file position and doesn't move it.
+     * This class doesn't close descriptor automatically
+     */
+    struct DirectReadBuffer : public std::streambuf, public Storage {
+        /**
+         * Initialize buffer for descriptor `d`. `chunk_size` is rounded up to logical block size
+         */
+        explicit DirectReadBuffer(int d, std::size_t chunk_size = 1024 * 1024);
+
+        /**
+         * Offset in file of next not buffered byte
+         */
+        inline off_t offset() const { return offset_; }
+
+    private:
+        int_type underflow();
+
+        DirectReadBuffer(const DirectReadBuffer &) = delete;
+
+        DirectReadBuffer &operator=(const DirectReadBuffer &) = delete;
+
+        size_t block_;
+        AlignedBuffer buffer_;
+        off_t offset_;
+    };
+
+    /**
+     * Writer for descriptors opened with O_DIRECT. Whole blocks are written from aligned buffer by pwrite,
+     * incomplete last block stays buffered until finish() (or destructor) which writes it with O_DIRECT
+     * temporary disabled. Writing starts at current file position; unaligned position disables direct mode.
+     * This class doesn't close descriptor automatically
+     */
+    struct DirectWriteBuffer : public std::streambuf, public Storage {
+        /**
+         * Initialize buffer for descriptor `d`. `chunk_size` is rounded up to logical block size
+         */
+        explicit DirectWriteBuffer(int d, std::size_t chunk_size = 1024 * 1024);
+
+        /**
+         * Write all data including unaligned tail. Returns false on error.
+         * Descriptor position is moved to end of written data
+         */
+        bool finish();
+
+        /**
+         * Offset in file of next not written byte
+         */
+        inline off_t offset() const { return offset_; }
+
+        ~DirectWriteBuffer();
+
+    private:
+        DirectWriteBuffer(const DirectWriteBuffer &) = delete;
+
+        DirectWriteBuffer &operator=(const DirectWriteBuffer &) = delete;
+
+        int_type overflow(int_type ch);
+
+        int sync();
+
+        bool write_blocks(bool tail);
+
+        size_t block_;
+        AlignedBuffer buffer_;
+        off_t offset_;
+        bool failed_ = false;
+    };
+}
+#endif //IO_DIRECT_H
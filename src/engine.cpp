@@ -0,0 +1,59 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+#include "engine.h"
+#include "async.h"
+#include <unistd.h>
+
+namespace io {
+    FileEngine::FileEngine(size_t threads) {
+        if (threads == 0) threads = 1;
+        for (size_t i = 0; i < threads; ++i) {
+            workers_.emplace_back([this]() {
+                std::function<void()> task;
+                while (queue_.pop(task)) task();
+            });
+        }
+    }
+
+    FileEngine &FileEngine::shared() {
+        static FileEngine engine;
+        return engine;
+    }
+
+    void FileEngine::read(Epoll &epoll, int fd, char *buffer, size_t size, off_t offset,
+                          const Completion &callback, const Finished &finished) {
+        Epoll *loop = &epoll;
+        queue_.push([loop, fd, buffer, size, offset, callback, finished]() {
+            ssize_t n;
+            do {
+                n = pread(fd, buffer, size, offset);
+            } while (n < 0 && errno == EINTR);
+            int error = n < 0 ? errno : 0;
+            size_t done = n > 0 ? static_cast<size_t>(n) : 0;
+            loop->post([callback, error, done]() { callback(error, done); });
+            if (finished) finished();
+        });
+    }
+
+    void FileEngine::write(Epoll &epoll, int fd, const char *buffer, size_t size, off_t offset,
+                           const Completion &callback, const Finished &finished) {
+        Epoll *loop = &epoll;
+        queue_.push([loop, fd, buffer, size, offset, callback, finished]() {
+            ssize_t n;
+            do {
+                n = pwrite(fd, buffer, size, offset);
+            } while (n < 0 && errno == EINTR);
+            int error = n < 0 ? errno : 0;
+            size_t done = n > 0 ? static_cast<size_t>(n) : 0;
+            loop->post([callback, error, done]() { callback(error, done); });
+            if (finished) finished();
+        });
+    }
+
+    FileEngine::~FileEngine() {
+        queue_.finish();
+        for (auto &worker:workers_) worker.join();
+    }
+}
@@ -0,0 +1,75 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+#ifndef IO_ENGINE_H
+#define IO_ENGINE_H
+
+#include "concurrent.h"
+#include <functional>
+#include <thread>
+#include <vector>
+#include <sys/types.h>
+
+namespace io {
+    struct Epoll;
+
+    /**
+     * Thread pool for regular file IO. Epoll can't watch regular files and their read/write blocks
+     * on disk, so requests are executed by pread/pwrite in workers and completions are posted back to the loop.
+     */
+    struct FileEngine {
+        /**
+         * Completion: error code (0 or errno) and count of transferred bytes. 0 bytes of read means EOF
+         */
+        using Completion = std::function<void(int, size_t)>;
+
+        /**
+         * Start `threads` workers
+         */
+        explicit FileEngine(size_t threads = 2);
+
+        /**
+         * Shared engine used by AbstractAsyncFile for regular files
+         */
+        static FileEngine &shared();
+
+        /**
+         * Called in worker after completion is posted: buffer, descriptor and Epoll are not used anymore
+         */
+        using Finished = std::function<void()>;
+
+        /**
+         * Read up to `size` bytes at `offset` into `buffer` and call `callback` in thread which polls `epoll`.
+         * Buffer and descriptor must stay valid until `finished`
+         */
+        void read(Epoll &epoll, int fd, char *buffer, size_t size, off_t offset, const Completion &callback,
+                  const Finished &finished = nullptr);
+
+        /**
+         * Write up to `size` bytes at `offset` (ignored for O_APPEND files) and call `callback` in thread
+         * which polls `epoll`. Buffer and descriptor must stay valid until `finished`
+         */
+        void write(Epoll &epoll, int fd, const char *buffer, size_t size, off_t offset, const Completion &callback,
+                   const Finished &finished = nullptr);
+
+        /**
+         * Count of worker threads
+         */
+        inline size_t threads() const { return workers_.size(); }
+
+        /**
+         * Stop workers. Not started requests are dropped
+         */
+        ~FileEngine();
+
+    private:
+        FileEngine(const FileEngine &) = delete;
+
+        FileEngine &operator=(const FileEngine &) = delete;
+
+        BlockingQueue<std::function<void()>> queue_;
+        std::vector<std::thread> workers_;
+    };
+}
+#endif //IO_ENGINE_H
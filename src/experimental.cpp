@@ -4,20 +4,108 @@
 
 #include "experimental.h"
 #include <string>
+#include <sys/timerfd.h>
+#include <unistd.h>
 
 namespace io {
 
     Publisher::Publisher(io::Epoll &epoll, io::ConnectionManager::Ptr serv_con_) : AsyncSocketServer(epoll,
                                                                                                      serv_con_) { }
 
+    Publisher::~Publisher() {
+        flush();
+        if (timer_fd_ >= 0) {
+            poller().remove(timer_fd_);
+            close(timer_fd_);
+        }
+    }
+
     void Publisher::publish() {
-        std::string content = line_.str();
-        auto lock = lock_collection();
-        for (auto &kv:clients_) {
-            kv.second->output() << content;
-            kv.second->output().flush();
-        }
-        line_.str("");
-        line_.clear();
+        std::string content;
+        {
+            std::lock_guard<std::mutex> guard(line_lock_);
+            content = line_.str();
+            line_.str("");
+            line_.clear();
+        }
+        publish(content);
+    }
+
+    void Publisher::publish(const std::string &content) {
+        if (!batching()) {
+            auto clients = clients_.snapshot();
+            for (auto &client:*clients) {
+                client->output() << content;
+                client->output().flush();
+            }
+            return;
+        }
+        bool full, first;
+        {
+            std::lock_guard<std::mutex> guard(batch_lock_);
+            first = batch_.empty();
+            batch_ += content;
+            full = batch_.size() >= max_bytes_;
+            if (first && !full) arm_deadline(true); // Under lock: flush of previous batch can't disarm it
+        }
+        charge(static_cast<int64_t>(content.size())); // Backlog counts in memory budget
+        if (full) {
+            flush();
+        } else if (first) {
+            if (each_iteration_) {
+                std::weak_ptr<char> alive = alive_;
+                poller().post([this, alive]() { if (alive.lock()) flush(); });
+            }
+        }
+    }
+
+    bool Publisher::set_batching(size_t max_bytes, uint64_t max_delay, bool each_iteration) {
+        flush();
+        if (max_bytes > 0 && max_delay > 0 && timer_fd_ < 0) {
+            timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+            if (timer_fd_ < 0) return false;
+            if (!poller().add<Publisher, &Publisher::on_deadline>(timer_fd_, EPOLLIN, this)) {
+                close(timer_fd_);
+                timer_fd_ = -1;
+                return false;
+            }
+        }
+        std::lock_guard<std::mutex> guard(batch_lock_);
+        max_bytes_ = max_bytes;
+        max_delay_ = max_delay;
+        each_iteration_ = each_iteration;
+        return true;
+    }
+
+    void Publisher::flush() {
+        std::lock_guard<std::mutex> order(flush_lock_); // Keep batches in order of publishing
+        std::string content;
+        {
+            std::lock_guard<std::mutex> guard(batch_lock_);
+            content.swap(batch_);
+            if (!content.empty()) arm_deadline(false);
+        }
+        if (content.empty()) return;
+        auto clients = clients_.snapshot();
+        for (auto &client:*clients) {
+            client->output().write(content.data(), content.size());
+            client->output().flush();
+        }
+        charge(-static_cast<int64_t>(content.size()));
+    }
+
+    void Publisher::arm_deadline(bool enable) { // Called under batch_lock_
+        if (timer_fd_ < 0) return;
+        itimerspec spec = {};
+        if (enable) {
+            spec.it_value.tv_sec = static_cast<time_t>(max_delay_ / 1000000);
+            spec.it_value.tv_nsec = static_cast<long>(max_delay_ % 1000000) * 1000;
+        }
+        timerfd_settime(timer_fd_, 0, &spec, nullptr);
+    }
+
+    void Publisher::on_deadline(io::Epoll &, uint32_t events, int fd) {
+        uint64_t expirations;
+        if (read(fd, &expirations, sizeof(expirations)) > 0) flush();
     }
-}
\ No newline at end of file
+}
@@ -8,6 +8,7 @@
 #include "io.h"
 #include "async.h"
 #include <sstream>
+#include <mutex>
 namespace io {
 
 
@@ -15,12 +16,55 @@ namespace io {
 
         Publisher(io::Epoll &epoll, io::ConnectionManager::Ptr serv_con_);
 
+        /**
+         * Message being composed. Single producer: other threads use publish(content)
+         */
         inline std::stringstream &line() { return line_; }
 
+        /**
+         * Send composed line() to all clients and reset it. In batching mode message is only queued
+         */
         void publish();
 
+        /**
+         * Send `content` to all clients. In batching mode message is only queued. Thread safe in batching mode
+         */
+        void publish(const std::string &content);
+
+        /**
+         * Enable batching: messages are accumulated and written to every client once per Epoll iteration
+         * (if `each_iteration`), or when `max_bytes` accumulated, or `max_delay` microseconds passed since first
+         * queued message, whichever comes first. Zero `max_bytes` disables batching. Returns false on error
+         */
+        bool set_batching(size_t max_bytes = 65536, uint64_t max_delay = 200, bool each_iteration = true);
+
+        inline bool batching() const { return max_bytes_ > 0; }
+
+        /**
+         * Write queued messages to all clients now
+         */
+        void flush();
+
+        /**
+         * Flush queued messages
+         */
+        virtual ~Publisher();
+
     protected:
         std::stringstream line_;
+
+    private:
+        void on_deadline(io::Epoll &, uint32_t events, int fd);
+
+        void arm_deadline(bool enable);
+
+        std::mutex line_lock_, batch_lock_, flush_lock_;
+        std::string batch_;
+        size_t max_bytes_ = 0;
+        uint64_t max_delay_ = 0;
+        bool each_iteration_ = true;
+        int timer_fd_ = -1;
+        std::shared_ptr<char> alive_ = std::make_shared<char>(0); // Guards posted flushes
     };
 
 }
@@ -0,0 +1,265 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+#include "follower.h"
+#include "async.h"
+#include <set>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace io {
+
+    FileFollower::FileFollower(Epoll &epoll, const Handler &handler, size_t chunk_size)
+            : epoll_(epoll), handler_(handler), chunk_(chunk_size > 0 ? chunk_size : 1) {
+        descriptor_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        set_auto_close(true);
+        if (descriptor_ < 0) {
+            set_error();
+            return;
+        }
+        if (!epoll_.add<FileFollower, &FileFollower::on_event>(descriptor_, EPOLLIN, this)) set_error();
+    }
+
+    FileFollower::~FileFollower() {
+        if (has_valid_descriptor()) epoll_.remove(descriptor_);
+        for (auto &kv:files_) close_file(kv.second);
+    }
+
+    bool FileFollower::follow(const std::string &path, bool from_end) {
+        if (!has_valid_descriptor()) return false;
+        if (files_.find(path) != files_.end()) return true;
+        Tracked file;
+        file.path = path;
+        size_t slash = path.rfind('/');
+        std::string directory = slash == std::string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+        file.name = slash == std::string::npos ? path : path.substr(slash + 1);
+        file.directory_watch = watch_directory(directory);
+        if (file.directory_watch < 0) {
+            set_error();
+            return false;
+        }
+        file.generation = ++generations_;
+        uint64_t generation = file.generation;
+        Tracked &tracked = files_[path] = std::move(file);
+        if (open_file(tracked, from_end)) drain(path, generation);
+        return true;
+    }
+
+    bool FileFollower::unfollow(const std::string &path) {
+        auto it = files_.find(path);
+        if (it == files_.end()) return false;
+        close_file(it->second);
+        release_directory(it->second.directory_watch);
+        files_.erase(it);
+        return true;
+    }
+
+    off_t FileFollower::offset(const std::string &path) const {
+        auto it = files_.find(path);
+        if (it == files_.end() || !it->second.reader) return -1;
+        return it->second.identity.offset;
+    }
+
+    void FileFollower::check_all() {
+        std::vector<std::string> paths;
+        for (auto &kv:files_) paths.push_back(kv.first);
+        for (auto &path:paths) check(path);
+    }
+
+    bool FileFollower::save_offsets(const std::string &state_file) {
+        std::string temp = state_file + ".tmp";
+        int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            set_error();
+            return false;
+        }
+        {
+            FileWriteBuffer buffer(fd);
+            std::ostream out(&buffer);
+            for (auto &kv:files_) {
+                if (!kv.second.reader) continue;
+                const Identity &id = kv.second.identity;
+                out << id.device << ' ' << id.inode << ' ' << id.offset << ' ' << kv.first << '\n';
+            }
+            out.flush();
+        }
+        bool done = fsync(fd) == 0;
+        ::close(fd);
+        if (!done || rename(temp.c_str(), state_file.c_str()) != 0) {
+            set_error();
+            unlink(temp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    bool FileFollower::load_offsets(const std::string &state_file) {
+        int fd = ::open(state_file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            set_error();
+            return false;
+        }
+        FileReadBuffer buffer(fd);
+        buffer.set_auto_close(true);
+        std::istream in(&buffer);
+        Identity id;
+        std::string path;
+        while (in >> id.device >> id.inode >> id.offset) {
+            in.get(); // Separator
+            if (!std::getline(in, path) || path.empty()) break;
+            restored_[path] = id;
+        }
+        return true;
+    }
+
+    void FileFollower::on_event(Epoll &, uint32_t, int fd) {
+        alignas(inotify_event) char buffer[4096];
+        std::set<std::string> changed;
+        bool overflow = false;
+        ssize_t n;
+        while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+            for (char *ptr = buffer; ptr < buffer + n;) {
+                const inotify_event *event = reinterpret_cast<const inotify_event *>(ptr);
+                ptr += sizeof(inotify_event) + event->len;
+                if (event->mask & IN_Q_OVERFLOW) {
+                    overflow = true;
+                    continue;
+                }
+                auto watch = file_watches_.find(event->wd);
+                if (watch != file_watches_.end()) {
+                    changed.insert(watch->second);
+                    if (event->mask & IN_IGNORED) { // Watch removed by kernel
+                        auto it = files_.find(watch->second);
+                        if (it != files_.end()) it->second.file_watch = -1;
+                        file_watches_.erase(watch);
+                    }
+                    continue;
+                }
+                if (event->len == 0 || directories_.find(event->wd) == directories_.end()) continue;
+                std::string name(event->name);
+                for (auto &kv:files_)
+                    if (kv.second.directory_watch == event->wd && kv.second.name == name) changed.insert(kv.first);
+            }
+        }
+        if (overflow) {
+            check_all();
+            return;
+        }
+        for (auto &path:changed) check(path); // Handlers may unfollow files
+    }
+
+    bool FileFollower::open_file(Tracked &file, bool from_end) {
+        int fd = ::open(file.path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            ::close(fd);
+            return false;
+        }
+        Identity id;
+        id.device = info.st_dev;
+        id.inode = info.st_ino;
+        auto restored = restored_.find(file.path);
+        if (restored != restored_.end()) {
+            if (restored->second.device == id.device && restored->second.inode == id.inode &&
+                restored->second.offset <= info.st_size)
+                id.offset = restored->second.offset;
+            restored_.erase(restored); // Only for first open
+        } else if (from_end) {
+            id.offset = info.st_size;
+        }
+        lseek(fd, id.offset, SEEK_SET);
+        file.identity = id;
+        file.removed = false;
+        file.reader.reset(new FileReadBuffer(fd, chunk_.size()));
+        file.reader->set_auto_close(true);
+        file.file_watch = inotify_add_watch(descriptor_, file.path.c_str(), IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF |
+                                                                            IN_DELETE_SELF);
+        if (file.file_watch >= 0) file_watches_[file.file_watch] = file.path;
+        notify(file.path, Opened);
+        return true;
+    }
+
+    void FileFollower::close_file(Tracked &file) {
+        if (file.file_watch >= 0) {
+            file_watches_.erase(file.file_watch);
+            inotify_rm_watch(descriptor_, file.file_watch);
+            file.file_watch = -1;
+        }
+        file.reader.reset();
+    }
+
+    FileFollower::Tracked *FileFollower::find_tracked(const std::string &path, uint64_t generation) {
+        auto it = files_.find(path);
+        return it != files_.end() && it->second.generation == generation ? &it->second : nullptr;
+    }
+
+    void FileFollower::check(const std::string &path) {
+        auto it = files_.find(path);
+        if (it == files_.end()) return;
+        uint64_t generation = it->second.generation;
+        Tracked *file = &it->second;
+        if (!file->reader) {
+            if (open_file(*file, false)) drain(path, generation);
+            return;
+        }
+        drain(path, generation);
+        if ((file = find_tracked(path, generation)) == nullptr || !file->reader) return;
+        struct stat info;
+        if (fstat(file->reader->descriptor(), &info) == 0 && info.st_size < file->identity.offset) {
+            lseek(file->reader->descriptor(), 0, SEEK_SET);
+            file->identity.offset = 0;
+            notify(path, Truncated);
+            drain(path, generation);
+            if ((file = find_tracked(path, generation)) == nullptr || !file->reader) return;
+        }
+        if (stat(path.c_str(), &info) != 0) { // Keep old file: writer still may append to it
+            if (!file->removed) {
+                file->removed = true;
+                notify(path, Removed);
+            }
+            return;
+        }
+        if (info.st_dev == file->identity.device && info.st_ino == file->identity.inode) return;
+        close_file(*file); // Old file is drained, switch to new one
+        notify(path, Rotated);
+        if ((file = find_tracked(path, generation)) == nullptr) return;
+        if (open_file(*file, false)) drain(path, generation);
+    }
+
+    void FileFollower::drain(const std::string &path, uint64_t generation) {
+        Tracked *file;
+        while ((file = find_tracked(path, generation)) != nullptr && file->reader) { // Handler may unfollow
+            std::streamsize n = file->reader->sgetn(chunk_.data(), static_cast<std::streamsize>(chunk_.size()));
+            if (n <= 0) break;
+            file->identity.offset += n;
+            if (handler_) handler_(path, chunk_.data(), static_cast<size_t>(n));
+        }
+    }
+
+    void FileFollower::notify(const std::string &path, Change change) {
+        if (on_change_) on_change_(path, change);
+    }
+
+    int FileFollower::watch_directory(const std::string &directory) {
+        int watch = inotify_add_watch(descriptor_, directory.c_str(), IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM |
+                                                                      IN_DELETE | IN_ONLYDIR);
+        if (watch < 0) return -1;
+        auto &entry = directories_[watch];
+        entry.first = directory;
+        ++entry.second;
+        return watch;
+    }
+
+    void FileFollower::release_directory(int watch) {
+        auto it = directories_.find(watch);
+        if (it == directories_.end()) return;
+        if (--it->second.second == 0) {
+            inotify_rm_watch(descriptor_, watch);
+            directories_.erase(it);
+        }
+    }
+}
@@ -0,0 +1,143 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+#ifndef IO_FOLLOWER_H
+#define IO_FOLLOWER_H
+
+#include "io.h"
+#include <functional>
+#include <map>
+#include <unordered_map>
+#include <sys/types.h>
+
+namespace io {
+    struct Epoll;
+
+    /**
+     * Follower of growing files (tail -f) driven by inotify events in Epoll.
+     * Only appended bytes are read. Truncated files are re-read from start, rotated (renamed or
+     * removed and re-created) files are drained and then reopened by path.
+     * Offsets can be saved and restored to resume after restart.
+     */
+    struct FileFollower : public Storage, public WithError {
+        /**
+         * Data handler: path of followed file, new bytes (not aligned to lines) and their size
+         */
+        using Handler = std::function<void(const std::string &, const char *, size_t)>;
+
+        enum Change {
+            Opened,   // File opened (at follow or after creation)
+            Truncated,// File became shorter then read offset, reading from start
+            Rotated,  // Path points to another file now, reading new file from start
+            Removed   // File removed and not re-created yet
+        };
+
+        /**
+         * Handler of file state changes: path and type of change
+         */
+        using ChangeHandler = std::function<void(const std::string &, Change)>;
+
+        /**
+         * Create inotify instance and register it in `epoll`. Check errors after it
+         */
+        FileFollower(Epoll &epoll, const Handler &handler, size_t chunk_size = 65536);
+
+        /**
+         * Remove from epoll and close all files
+         */
+        ~FileFollower();
+
+        /**
+         * Start following file. If file doesn't exist it will be opened after creation.
+         * Start position is restored offset (see load_offsets) if file is the same, otherwise
+         * end of file if `from_end` or start of file. Existing data is read immediately
+         */
+        bool follow(const std::string &path, bool from_end = false);
+
+        /**
+         * Stop following file
+         */
+        bool unfollow(const std::string &path);
+
+        /**
+         * Set handler of truncation/rotation events
+         */
+        inline void set_change_handler(const ChangeHandler &handler) { on_change_ = handler; }
+
+        /**
+         * Read offset of followed file or -1
+         */
+        off_t offset(const std::string &path) const;
+
+        /**
+         * Check all files and read new data. Useful after missed events (e.g. queue overflow)
+         */
+        void check_all();
+
+        /**
+         * Atomically save offsets (with file identity) of followed files to `state_file`
+         */
+        bool save_offsets(const std::string &state_file);
+
+        /**
+         * Load offsets saved by save_offsets. Must be called before follow()
+         */
+        bool load_offsets(const std::string &state_file);
+
+    private:
+        struct Identity {
+            dev_t device = 0;
+            ino_t inode = 0;
+            off_t offset = 0;
+        };
+
+        struct Tracked {
+            std::string path;
+            std::string name;    // Name in directory
+            int directory_watch = -1;
+            int file_watch = -1;
+            std::unique_ptr<FileReadBuffer> reader;
+            Identity identity;
+            bool removed = false;
+            uint64_t generation = 0; // Tells re-followed path from entry seen before callbacks
+        };
+
+        FileFollower(const FileFollower &) = delete;
+
+        FileFollower &operator=(const FileFollower &) = delete;
+
+        void on_event(Epoll &, uint32_t events, int fd);
+
+        bool open_file(Tracked &file, bool from_end);
+
+        void close_file(Tracked &file);
+
+        /**
+         * Entry of `path` if it wasn't unfollowed (or replaced) since `generation` was taken, otherwise null.
+         * Handlers may change files_, so entries are looked up again after every callback
+         */
+        Tracked *find_tracked(const std::string &path, uint64_t generation);
+
+        void check(const std::string &path);
+
+        void drain(const std::string &path, uint64_t generation);
+
+        void notify(const std::string &path, Change change);
+
+        int watch_directory(const std::string &directory);
+
+        void release_directory(int watch);
+
+        Epoll &epoll_;
+        Handler handler_;
+        ChangeHandler on_change_;
+        std::vector<char> chunk_;
+        std::map<std::string, Tracked> files_;
+        std::unordered_map<int, std::string> file_watches_;      // File watch -> path
+        std::unordered_map<int, std::pair<std::string, size_t>> directories_; // Directory watch -> path, users
+        std::map<std::string, Identity> restored_;
+        uint64_t generations_ = 0;
+    };
+}
+#endif //IO_FOLLOWER_H
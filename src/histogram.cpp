@@ -0,0 +1,106 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+#include "histogram.h"
+#include <cstdio>
+
+namespace io {
+
+    LatencyHistogram::LatencyHistogram() {
+        reset();
+    }
+
+    size_t LatencyHistogram::bucket_of(uint64_t value) {
+        if (value < 2 * SubBuckets) return static_cast<size_t>(value);
+        size_t shift = static_cast<size_t>(63 - __builtin_clzll(value)) - 5; // Keep 6 significant bits
+        return (shift + 1) * SubBuckets + static_cast<size_t>((value >> shift) - SubBuckets);
+    }
+
+    uint64_t LatencyHistogram::bucket_limit(size_t bucket) {
+        if (bucket < 2 * SubBuckets) return bucket;
+        size_t shift = bucket / SubBuckets - 1;
+        uint64_t base = static_cast<uint64_t>(bucket % SubBuckets + SubBuckets) << shift;
+        return base + ((uint64_t(1) << shift) - 1);
+    }
+
+    void LatencyHistogram::record(uint64_t value) {
+        buckets_[bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(value, std::memory_order_relaxed);
+        uint64_t current = min_.load(std::memory_order_relaxed);
+        while (value < current && !min_.compare_exchange_weak(current, value, std::memory_order_relaxed)) { }
+        current = max_.load(std::memory_order_relaxed);
+        while (value > current && !max_.compare_exchange_weak(current, value, std::memory_order_relaxed)) { }
+    }
+
+    void LatencyHistogram::merge(const LatencyHistogram &other) {
+        if (other.count() == 0) return;
+        for (size_t i = 0; i < Buckets; ++i) {
+            uint64_t n = other.buckets_[i].load(std::memory_order_relaxed);
+            if (n > 0) buckets_[i].fetch_add(n, std::memory_order_relaxed);
+        }
+        count_.fetch_add(other.count(), std::memory_order_relaxed);
+        sum_.fetch_add(other.sum_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        uint64_t value = other.min(), current = min_.load(std::memory_order_relaxed);
+        while (value < current && !min_.compare_exchange_weak(current, value, std::memory_order_relaxed)) { }
+        value = other.max();
+        current = max_.load(std::memory_order_relaxed);
+        while (value > current && !max_.compare_exchange_weak(current, value, std::memory_order_relaxed)) { }
+    }
+
+    void LatencyHistogram::reset() {
+        for (auto &bucket:buckets_) bucket.store(0, std::memory_order_relaxed);
+        count_.store(0, std::memory_order_relaxed);
+        sum_.store(0, std::memory_order_relaxed);
+        min_.store(UINT64_MAX, std::memory_order_relaxed);
+        max_.store(0, std::memory_order_relaxed);
+    }
+
+    uint64_t LatencyHistogram::count() const {
+        return count_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t LatencyHistogram::min() const {
+        return count() == 0 ? 0 : min_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t LatencyHistogram::max() const {
+        return max_.load(std::memory_order_relaxed);
+    }
+
+    double LatencyHistogram::mean() const {
+        uint64_t total = count();
+        return total == 0 ? 0 : static_cast<double>(sum_.load(std::memory_order_relaxed)) / total;
+    }
+
+    uint64_t LatencyHistogram::percentile(double percent) const {
+        uint64_t total = 0;
+        for (auto &bucket:buckets_) total += bucket.load(std::memory_order_relaxed);
+        if (total == 0) return 0;
+        if (percent > 100) percent = 100;
+        uint64_t rank = static_cast<uint64_t>(percent / 100.0 * total + 0.5);
+        if (rank == 0) rank = 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < Buckets; ++i) {
+            seen += buckets_[i].load(std::memory_order_relaxed);
+            if (seen >= rank) {
+                uint64_t limit = bucket_limit(i), highest = max();
+                return limit < highest ? limit : highest; // Bucket may be wider then real values
+            }
+        }
+        return max();
+    }
+
+    std::string LatencyHistogram::summary(double scale, const std::string &unit) const {
+        if (scale <= 0) scale = 1;
+        char line[320];
+        const char *u = unit.c_str();
+        snprintf(line, sizeof(line),
+                 "count=%llu min=%.1f%s mean=%.1f%s p50=%.1f%s p90=%.1f%s p99=%.1f%s p99.9=%.1f%s max=%.1f%s",
+                 static_cast<unsigned long long>(count()), min() / scale, u, mean() / scale, u,
+                 percentile(50) / scale, u, percentile(90) / scale, u, percentile(99) / scale, u,
+                 percentile(99.9) / scale, u, max() / scale, u);
+        return line;
+    }
+}
@@ -0,0 +1,75 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+#ifndef IO_HISTOGRAM_H
+#define IO_HISTOGRAM_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace io {
+
+    /**
+     * Log-linear histogram of non negative values (usually nanoseconds) with relative error below 1/32.
+     * Every power of 2 is split to 32 linear buckets, values below 64 are exact.
+     * Recording is lock-free and safe from many threads, reports are approximate while recording goes on.
+     */
+    struct LatencyHistogram {
+        enum : size_t {
+            SubBuckets = 32,
+            Buckets = 60 * SubBuckets
+        };
+
+        LatencyHistogram();
+
+        /**
+         * Count `value` once
+         */
+        void record(uint64_t value);
+
+        /**
+         * Add all values of `other`
+         */
+        void merge(const LatencyHistogram &other);
+
+        void reset();
+
+        uint64_t count() const;
+
+        uint64_t min() const;
+
+        uint64_t max() const;
+
+        double mean() const;
+
+        /**
+         * Value below which `percent` (0..100) of recorded values are. Upper bound of bucket is returned,
+         * so result is never less then real percentile. 0 if histogram is empty
+         */
+        uint64_t percentile(double percent) const;
+
+        /**
+         * One line report: count, min, mean, p50, p90, p99, p99.9, max. Values are divided by `scale`
+         * and suffixed by `unit`, for example 1000 and "us" for nanoseconds
+         */
+        std::string summary(double scale = 1000, const std::string &unit = "us") const;
+
+        /**
+         * Bucket of value and highest value of bucket
+         */
+        static size_t bucket_of(uint64_t value);
+
+        static uint64_t bucket_limit(size_t bucket);
+
+    private:
+        LatencyHistogram(const LatencyHistogram &) = delete;
+
+        LatencyHistogram &operator=(const LatencyHistogram &) = delete;
+
+        std::atomic<uint64_t> buckets_[Buckets];
+        std::atomic<uint64_t> count_, sum_, min_, max_;
+    };
+}
+#endif //IO_HISTOGRAM_H
@@ -3,12 +3,20 @@
 //
 
 #include "io.h"
+#include "activation.h"
+#include "trace.h"
+#include "timestamp.h"
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <cstring>
+#include <cerrno>
 
 namespace io {
     Storage::Storage(int fd, bool close_at_end) : descriptor_(fd), auto_close_(close_at_end) { }
@@ -35,6 +43,25 @@ namespace io {
         if (auto_close_)close();
     }
 
+    /**
+     * Advise kernel to drop cached pages of last `length` bytes before current position
+     * and `lookbehind` bytes before them
+     */
+    static void drop_cached(int fd, size_t length, size_t lookbehind) {
+        off_t end = lseek(fd, 0, SEEK_CUR);
+        if (end < 0) return; // Not seekable
+        off_t start = end - static_cast<off_t>(length + lookbehind);
+        if (start < 0) start = 0;
+        posix_fadvise(fd, start, end - start, POSIX_FADV_DONTNEED);
+    }
+
+    /**
+     * Classify failed read/write
+     */
+    static BufferStatus failure_status() {
+        return errno == EAGAIN || errno == EWOULDBLOCK ? BufferStatus::WouldBlock : BufferStatus::Failed;
+    }
+
     FileReadBuffer::FileReadBuffer(int d, std::size_t chunk_size)
             : chunk_(chunk_size), buffer_(chunk_size) {
         descriptor_ = d;
@@ -43,15 +70,43 @@ namespace io {
     std::streambuf::int_type FileReadBuffer::underflow() {
         if (gptr() < egptr())  // buffer not exhausted
             return traits_type::to_int_type(*gptr());
-        if (!has_valid_descriptor()) traits_type::eof();
-        ssize_t n = read(descriptor_, buffer_.data(), chunk_);
-        if (n <= 0) return traits_type::eof();
+        if (!has_valid_descriptor()) return traits_type::eof();
+        if (buffer_.size() < chunk_) buffer_.resize(chunk_); // Released by shrink()
+        ssize_t n;
+        do {
+            n = read(descriptor_, buffer_.data(), chunk_);
+        } while (n < 0 && errno == EINTR);
+        if (n == 0) {
+            status_ = BufferStatus::EndOfFile;
+            return traits_type::eof();
+        }
+        if (n < 0) {
+            status_ = failure_status();
+            return traits_type::eof();
+        }
+        status_ = BufferStatus::Ready;
+        if (drop_cache_) drop_cached(descriptor_, static_cast<size_t>(n), 0);
         char *base = &buffer_.front();
         char *start = base;
         setg(base, start, start + n);
         return traits_type::to_int_type(*gptr());
     }
 
+    bool FileReadBuffer::shrink() {
+        if (gptr() < egptr() || buffer_.capacity() == 0) return false;
+        setg(nullptr, nullptr, nullptr);
+        std::vector<char>().swap(buffer_);
+        return true;
+    }
+
+    std::streamsize FileReadBuffer::showmanyc() {
+        if (!has_valid_descriptor() || status_ == BufferStatus::EndOfFile || status_ == BufferStatus::Failed)
+            return -1;
+        int available = 0;
+        if (ioctl(descriptor_, FIONREAD, &available) != 0) return 0; // Unknown
+        return available;
+    }
+
     FileWriteBuffer::FileWriteBuffer(int d, std::size_t chunk_size)
             : chunk_(chunk_size), buffer_(chunk_size) {
         descriptor_ = d;
@@ -59,24 +114,89 @@ namespace io {
 
     std::streambuf::int_type FileWriteBuffer::overflow(
             std::streambuf::int_type ch) {
-        if (!has_valid_descriptor()) traits_type::eof();
+        if (!has_valid_descriptor()) return traits_type::eof();
         if (ch == traits_type::eof()) {
             sync();
             return traits_type::eof();
         }
-        buffer_[count_++] = ch;
-        if (count_ >= chunk_) return sync();
+        bool blocked = count_ >= chunk_ && sync() != 0;
+        if (blocked && status_ != BufferStatus::WouldBlock) return traits_type::eof();
+        allocate();
+        char c = traits_type::to_char_type(ch);
+        keep(&c, 1); // Accepted character stays in buffer if descriptor would block
+        if (!blocked && count_ >= chunk_ && sync() != 0 && status_ != BufferStatus::WouldBlock)
+            return traits_type::eof();
         return ch;
     }
 
+    std::streamsize FileWriteBuffer::xsputn(const char *data, std::streamsize size) {
+        if (!has_valid_descriptor() || size <= 0) return 0;
+        allocate();
+        size_t length = static_cast<size_t>(size);
+        if (count_ + length < chunk_) {
+            std::memcpy(&buffer_[count_], data, length);
+            count_ += length;
+            return size;
+        }
+        if (sync() != 0) {
+            if (status_ != BufferStatus::WouldBlock) return 0;
+            keep(data, length); // Whole block waits for flush on EPOLLOUT
+            return size;
+        }
+        if (length < chunk_) {
+            std::memcpy(&buffer_[0], data, length);
+            count_ = length;
+            return size;
+        }
+        trace::Span span(trace::WriteStall, descriptor_, length); // Large block goes around buffer
+        size_t count = 0;
+        while (count < length) {
+            ssize_t part = write(descriptor_, data + count, length - count);
+            if (part < 0 && errno == EINTR) continue;
+            if (part <= 0) {
+                status_ = part < 0 ? failure_status() : BufferStatus::Failed;
+                break;
+            }
+            count += static_cast<size_t>(part);
+        }
+        if (count == length) status_ = BufferStatus::Ready;
+        if (drop_cache_) drop_cached(descriptor_, count, length);
+        if (count < length && status_ == BufferStatus::WouldBlock) { // Unwritten tail waits for flush
+            keep(data + count, length - count);
+            return size;
+        }
+        return static_cast<std::streamsize>(count);
+    }
+
+    void FileWriteBuffer::keep(const char *data, std::size_t length) {
+        if (buffer_.size() < count_ + length) buffer_.resize(count_ + length);
+        std::memcpy(&buffer_[count_], data, length);
+        count_ += length;
+    }
+
+    bool FileWriteBuffer::shrink() {
+        if (count_ > 0 || buffer_.capacity() == 0) return false;
+        std::vector<char>().swap(buffer_);
+        return true;
+    }
+
     int FileWriteBuffer::sync() {
-        ssize_t part = 1;
+        if (count_ == 0) return 0;
+        trace::Span span(trace::WriteStall, descriptor_, count_);
         size_t count = 0;
         while (count < count_) {
-            part = write(descriptor_, &buffer_[count], count_ - count);
-            if (part <= 0) return traits_type::eof();
+            ssize_t part = write(descriptor_, &buffer_[count], count_ - count);
+            if (part < 0 && errno == EINTR) continue;
+            if (part <= 0) { // Keep unwritten tail for next attempt
+                status_ = part < 0 ? failure_status() : BufferStatus::Failed;
+                if (count > 0) std::memmove(&buffer_[0], &buffer_[count], count_ - count);
+                count_ -= count;
+                return -1;
+            }
             count += static_cast<size_t>(part);
         }
+        status_ = BufferStatus::Ready;
+        if (drop_cache_) drop_cached(descriptor_, count_, 4 * chunk_);
         count_ = 0;
         return 0;
     }
@@ -131,22 +251,164 @@ namespace io {
 
     }
 
-    TcpServerManager::TcpServerManager(const std::string &service, const std::string &bind_host, int backlog) {
+    SocketOptions SocketOptions::low_latency() {
+        SocketOptions options;
+        options.busy_poll = 50;
+        options.prefer_busy_poll = true;
+        options.no_delay = true;
+        options.quick_ack = true;
+        return options;
+    }
+
+    bool apply_socket_options(int fd, const SocketOptions &options) {
+        bool ok = true;
+        int opt;
+        if (options.receive_buffer > 0)
+            ok &= setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &options.receive_buffer, sizeof(int)) == 0;
+        if (options.send_buffer > 0)
+            ok &= setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &options.send_buffer, sizeof(int)) == 0;
+        // Busy polling above net.core.busy_read needs CAP_NET_ADMIN: unprivileged servers run without it
+        if (options.busy_poll > 0 && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &options.busy_poll, sizeof(int)) != 0)
+            ok &= errno == EPERM;
+        if (options.incoming_cpu >= 0)
+            ok &= setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &options.incoming_cpu, sizeof(int)) == 0;
+        if (options.reuse_port) {
+            opt = 1;
+            ok &= setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == 0;
+        }
+#ifdef SO_PREFER_BUSY_POLL
+        if (options.prefer_busy_poll) {
+            opt = 1;
+            if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &opt, sizeof(opt)) != 0) ok &= errno == EPERM;
+        }
+#endif
+        if (options.timestamping || options.transmit_timestamps)
+            ok &= enable_timestamping(fd, options.transmit_timestamps);
+        int type = 0;
+        socklen_t length = sizeof(type);
+        if (!options.no_delay && !options.quick_ack) return ok;
+        if (getsockopt(fd, SOL_SOCKET, SO_PROTOCOL, &type, &length) < 0 || type != IPPROTO_TCP) return ok;
+        opt = 1;
+        if (options.no_delay) ok &= setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt)) == 0;
+        if (options.quick_ack) ok &= setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &opt, sizeof(opt)) == 0;
+        return ok;
+    }
+
+    int connect_tcp(const std::string &host, const std::string &service) {
+        addrinfo hints, *result = nullptr;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host.c_str(), service.c_str(), &hints, &result) != 0) return -1;
+        int fd = -1;
+        for (addrinfo *item = result; item != nullptr; item = item->ai_next) {
+            fd = socket(item->ai_family, item->ai_socktype | SOCK_CLOEXEC, item->ai_protocol);
+            if (fd < 0) continue;
+            if (connect(fd, item->ai_addr, item->ai_addrlen) == 0) break;
+            ::close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(result);
+        return fd;
+    }
+
+    int connect_unix(const std::string &path) {
+        struct sockaddr_un address;
+        if (path.size() >= sizeof(address.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        if (connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+            int error = errno;
+            ::close(fd);
+            errno = error;
+            return -1;
+        }
+        return fd;
+    }
+
+    int bind_udp(const std::string &service, const std::string &bind_host, const SocketOptions &options) {
+        addrinfo hints, *result = nullptr;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        hints.ai_flags = AI_PASSIVE;
+        if (getaddrinfo(bind_host.c_str(), service.c_str(), &hints, &result) != 0) return -1;
+        int fd = -1;
+        for (addrinfo *item = result; item != nullptr; item = item->ai_next) {
+            fd = socket(item->ai_family, item->ai_socktype | SOCK_CLOEXEC, item->ai_protocol);
+            if (fd < 0) continue;
+            if (apply_socket_options(fd, options) && bind(fd, item->ai_addr, item->ai_addrlen) == 0) break;
+            int error = errno;
+            ::close(fd);
+            errno = error;
+            fd = -1;
+        }
+        freeaddrinfo(result);
+        return fd;
+    }
+
+    bool TcpServerManager::set_socket_options(const SocketOptions &options) {
+        options_ = options;
+        if (!is_active()) return false;
+        SocketOptions server = options; // Buffers and busy polling are inherited by accepted sockets
+        server.no_delay = false;
+        server.quick_ack = false;
+        server.timestamping = server.transmit_timestamps = false; // Not allowed on listener, set on accept
+        if (!apply_socket_options(descriptor_, server)) {
+            set_error();
+            return false;
+        }
+        return true;
+    }
+
+    int TcpServerManager::next_descriptor() {
+        int client = AbstractSocketManager::next_descriptor();
+        if (client >= 0) { // Best effort for clients. Listener only options are inherited or meaningless here
+            SocketOptions options = options_;
+            options.incoming_cpu = -1;
+            options.reuse_port = false;
+            options.receive_buffer = 0;
+            options.send_buffer = 0;
+            apply_socket_options(client, options);
+        }
+        return client;
+    }
+
+    TcpServerManager::TcpServerManager(const std::string &service, const std::string &bind_host, int backlog)
+            : TcpServerManager(service, bind_host, backlog, SocketOptions()) { }
+
+    TcpServerManager::TcpServerManager(const std::string &service, const std::string &bind_host, int backlog,
+                                       const SocketOptions &options) : options_(options) {
         descriptor_ = socket(AF_INET6, SOCK_STREAM, 0);
         if (!has_valid_descriptor()) return;
-        AddressInfo info(bind_host, service);
-        if (info.has_error()) {
+        SocketOptions server = options;
+        server.no_delay = false;
+        server.quick_ack = false;
+        server.timestamping = server.transmit_timestamps = false; // Not allowed on listener, set on accept
+        if (!apply_socket_options(descriptor_, server)) {
             set_error();
             close();
             return;
         }
-        if (bind(descriptor_, (*info)->ai_addr, (*info)->ai_addrlen) < 0) {
+        int opt = 1; // Must be set before bind to reuse port in TIME_WAIT after restart
+        if (setsockopt(descriptor_, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
             set_error();
             close();
             return;
         }
-        int opt = 1;
-        if (setsockopt(descriptor_, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
+        AddressInfo info(bind_host, service);
+        if (info.has_error()) {
+            set_error();
+            close();
+            return;
+        }
+        if (bind(descriptor_, (*info)->ai_addr, (*info)->ai_addrlen) < 0) {
             set_error();
             close();
             return;
@@ -187,6 +449,53 @@ namespace io {
             close();
             return;
         }
+        struct stat info;
+        if (stat(path.c_str(), &info) == 0) {
+            device_ = info.st_dev;
+            inode_ = info.st_ino;
+        }
+    }
+
+    /**
+     * Check that `fd` is listening socket of `family`
+     */
+    static bool is_listening_socket(int fd, int family) {
+        int listening = 0;
+        socklen_t length = sizeof(listening);
+        if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &length) < 0) return false;
+        if (!listening) {
+            errno = EINVAL;
+            return false;
+        }
+        sockaddr_storage address;
+        length = sizeof(address);
+        if (getsockname(fd, reinterpret_cast<sockaddr *>(&address), &length) < 0) return false;
+        bool matched = family == AF_UNIX ? address.ss_family == AF_UNIX :
+                       address.ss_family == AF_INET || address.ss_family == AF_INET6;
+        if (!matched) errno = EAFNOSUPPORT;
+        return matched;
+    }
+
+    TcpServerManager::TcpServerManager(int fd) {
+        descriptor_ = fd;
+        if (!is_listening_socket(fd, AF_INET6)) {
+            set_error();
+            descriptor_ = -1;
+        }
+    }
+
+    UnixServerManager::UnixServerManager(int fd) : remove_on_close_(false) {
+        descriptor_ = fd;
+        if (!is_listening_socket(fd, AF_UNIX)) {
+            set_error();
+            descriptor_ = -1;
+            return;
+        }
+        sockaddr_un address;
+        socklen_t length = sizeof(address);
+        memset(&address, 0, sizeof(address));
+        if (getsockname(fd, reinterpret_cast<sockaddr *>(&address), &length) == 0 && address.sun_path[0] != 0)
+            path_ = std::string(address.sun_path, strnlen(address.sun_path, sizeof(address.sun_path)));
     }
 
     std::shared_ptr<TcpServerManager> TcpServerManager::create(const std::string &service, std::string const &bind_host,
@@ -198,8 +507,19 @@ namespace io {
         return std::make_shared<UnixServerManager>(path, backlog, mode);
     }
 
+    std::shared_ptr<TcpServerManager> TcpServerManager::adopt(int fd) {
+        return std::make_shared<TcpServerManager>(fd);
+    }
+
+    std::shared_ptr<UnixServerManager> UnixServerManager::adopt(int fd) {
+        return std::make_shared<UnixServerManager>(fd);
+    }
+
     UnixServerManager::~UnixServerManager() {
-        remove(path_.c_str());
+        if (!remove_on_close_ || inode_ == 0 || handed_over(device_, inode_)) return; // Successor serves the path
+        struct stat info; // Don't remove socket of successor bound to same path
+        if (stat(path_.c_str(), &info) == 0 && info.st_dev == device_ && info.st_ino == inode_)
+            remove(path_.c_str());
     }
 
 
@@ -216,6 +536,38 @@ namespace io {
         return std::make_shared<FileStream>(fd);
     }
 
+    bool FileStream::set_non_blocking(bool enable) {
+        int flags = fcntl(descriptor_, F_GETFL);
+        if (flags < 0) return false;
+        flags = enable ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+        return fcntl(descriptor_, F_SETFL, flags) == 0;
+    }
+
+    void FileStream::close() {
+        input_buffer.descriptor_ = -1;
+        output_buffer.descriptor_ = -1;
+        Storage::close();
+    }
+
+    void FileStream::hangup() {
+        if (descriptor_ < 0) return;
+        int null = open("/dev/null", O_RDWR | O_CLOEXEC);
+        if (null < 0 || dup3(null, descriptor_, O_CLOEXEC) < 0) shutdown(descriptor_, SHUT_RDWR);
+        if (null >= 0) ::close(null);
+    }
+
+    std::size_t FileStream::shrink(bool input, bool output) {
+        std::size_t before = memory_usage();
+        if (input) input_buffer.shrink();
+        if (output) output_buffer.shrink();
+        return before - memory_usage();
+    }
+
+    void FileStream::rearm() {
+        if (input_buffer.would_block()) input_.clear();
+        if (output_buffer.would_block()) output_.clear();
+    }
+
     const std::string &version() {
         static std::string version_ = BUILD_VERSION;
         return version_;
@@ -5,6 +5,7 @@
 #include <vector>
 #include <memory>
 #include <netdb.h>
+#include <sys/types.h>
 #include <cstring>
 #include <iostream>
 
@@ -141,8 +142,19 @@ namespace io {
         mutable std::string error_message_;
     };
 
+    /**
+     * Result of last descriptor operation of FileReadBuffer/FileWriteBuffer
+     */
+    enum class BufferStatus {
+        Ready,      // Last operation succeeded
+        WouldBlock, // Non-blocking descriptor is not ready (EAGAIN): wait for readiness and retry
+        EndOfFile,  // Peer closed or end of file reached
+        Failed      // IO error, see errno
+    };
+
 /**
  * Reader from file descriptor. If descriptor less then 0 or `read` returns less or equal 0, EOF will be set.
+ * On non-blocking descriptor EOF is also returned when no data is ready, status() tells them apart.
  * This class doesn't close descriptor automatically
  */
     struct FileReadBuffer : public std::streambuf, public Storage {
@@ -152,20 +164,59 @@ namespace io {
          */
         explicit FileReadBuffer(int d, std::size_t chunk_size = 8192);
 
+        /**
+         * Drop read pages from page cache (posix_fadvise DONTNEED) to keep bulk reads from evicting hot data
+         */
+        inline void set_drop_cache(bool enable) { drop_cache_ = enable; }
+
+        inline bool drop_cache() const { return drop_cache_; }
+
+        /**
+         * Status of last read
+         */
+        inline BufferStatus status() const { return status_; }
+
+        inline bool would_block() const { return status_ == BufferStatus::WouldBlock; }
+
+        /**
+         * Bytes read from descriptor but not consumed yet
+         */
+        inline std::size_t buffered() const { return static_cast<std::size_t>(egptr() - gptr()); }
+
+        /**
+         * Bytes held by buffer
+         */
+        inline std::size_t memory_usage() const { return buffer_.capacity(); }
+
+        /**
+         * Release buffer if it has no unread data. It's allocated again by next read. Returns true if released
+         */
+        bool shrink();
+
     private:
         int_type underflow();
 
+        /**
+         * Bytes readable without blocking (FIONREAD), -1 after end of file or error
+         */
+        std::streamsize showmanyc();
+
         FileReadBuffer(const FileReadBuffer &) = delete;
 
         FileReadBuffer &operator=(const FileReadBuffer &) = delete;
 
+        friend struct FileStream;
+
         std::size_t chunk_;
         std::vector<char> buffer_;
+        bool drop_cache_ = false;
+        BufferStatus status_ = BufferStatus::Ready;
     };
 
 /**
  *  Writer to file descriptor. If descriptor less then 0 or `write` returns less or equal 0, EOF will be set.
- *  his class doesn't close descriptor automatically
+ *  On non-blocking descriptor unwritten part is kept in buffer and sent by next flush when descriptor
+ *  becomes writable. This class doesn't close descriptor automatically
  */
     struct FileWriteBuffer : public std::streambuf, public Storage {
     public:
@@ -175,17 +226,63 @@ namespace io {
          */
         explicit FileWriteBuffer(int d, std::size_t chunk_size = 8192);
 
+        /**
+         * Drop written pages from page cache (posix_fadvise DONTNEED). Dirty pages are scheduled for
+         * writeback first and dropped by following writes
+         */
+        inline void set_drop_cache(bool enable) { drop_cache_ = enable; }
+
+        inline bool drop_cache() const { return drop_cache_; }
+
+        /**
+         * Status of last write
+         */
+        inline BufferStatus status() const { return status_; }
+
+        inline bool would_block() const { return status_ == BufferStatus::WouldBlock; }
+
+        /**
+         * Bytes waiting in buffer. Buffer grows beyond chunk size to keep everything written while
+         * descriptor would block, so stream never refuses data on EAGAIN
+         */
+        inline std::size_t pending() const { return count_; }
+
+        /**
+         * Bytes held by buffer
+         */
+        inline std::size_t memory_usage() const { return buffer_.capacity(); }
+
+        /**
+         * Release buffer if it has no pending data. It's allocated again by next write. Returns true if released
+         */
+        bool shrink();
+
     private:
+        inline void allocate() {
+            if (buffer_.size() < chunk_) buffer_.resize(chunk_);
+        }
+
+        /**
+         * Append `length` bytes to pending data, growing buffer when needed
+         */
+        void keep(const char *data, std::size_t length);
+
         FileWriteBuffer(const FileWriteBuffer &) = delete;
 
         FileWriteBuffer &operator=(const FileWriteBuffer &) = delete;
 
+        friend struct FileStream;
+
         int_type overflow(int_type ch);
 
+        std::streamsize xsputn(const char *data, std::streamsize size);
+
         int sync();
 
         std::size_t chunk_, count_ = 0;
         std::vector<char> buffer_;
+        bool drop_cache_ = false;
+        BufferStatus status_ = BufferStatus::Ready;
     };
 
 /**
@@ -223,6 +320,49 @@ namespace io {
         addrinfo *info_ = nullptr;
     };
 
+/**
+ * Socket tuning. Default values keep system defaults
+ */
+    struct SocketOptions {
+        int busy_poll = 0;             // SO_BUSY_POLL in microseconds, 0 - disabled. Best effort: skipped without
+                                       // CAP_NET_ADMIN (EPERM) unless net.core.busy_read allows the value
+        bool prefer_busy_poll = false; // SO_PREFER_BUSY_POLL (Linux 5.11+), best effort as busy_poll
+        bool no_delay = false;         // TCP_NODELAY
+        bool quick_ack = false;        // TCP_QUICKACK. Kernel drops it after delayed ACK, so it is set on accept only
+        int receive_buffer = 0;        // SO_RCVBUF in bytes, 0 - system default
+        int send_buffer = 0;           // SO_SNDBUF in bytes, 0 - system default
+        int incoming_cpu = -1;         // SO_INCOMING_CPU of listener: accept connections received on this CPU
+        bool reuse_port = false;       // SO_REUSEPORT (before bind only): listener per reactor, see incoming_cpu
+        bool timestamping = false;     // SO_TIMESTAMPING software RX timestamps, see timestamp.h
+        bool transmit_timestamps = false; // Also TX timestamps. Error queue raises EPOLLERR until drained
+
+        /**
+         * Profile for latency critical servers: busy polling 50us (if permitted), no Nagle and no delayed ACK
+         */
+        static SocketOptions low_latency();
+    };
+
+    /**
+     * Apply options to socket `fd`. TCP options are ignored for non TCP sockets. Returns false if any option failed
+     */
+    bool apply_socket_options(int fd, const SocketOptions &options);
+
+    /**
+     * Connect TCP socket to `host` and `service` (first reachable address). Returns descriptor or -1
+     */
+    int connect_tcp(const std::string &host, const std::string &service);
+
+    /**
+     * Connect UNIX stream socket to `path`. Returns descriptor or -1
+     */
+    int connect_unix(const std::string &path);
+
+    /**
+     * Create UDP socket bound to `bind_host` and port `service` with `options`. Returns descriptor or -1
+     */
+    int bind_udp(const std::string &service, const std::string &bind_host = "::",
+                 const SocketOptions &options = SocketOptions());
+
 /**
 * Connection manager for new requests. For example via Unix or Tcp socket
 */
@@ -237,6 +377,11 @@ namespace io {
         */
         virtual int next_descriptor() = 0;
 
+        /**
+        * Called by servers after descriptor returned by next_descriptor() is closed
+        */
+        virtual void on_descriptor_closed(int fd) { }
+
         virtual ~ConnectionManager();
 
         typedef std::shared_ptr<ConnectionManager> Ptr;
@@ -286,9 +431,40 @@ namespace io {
         */
         TcpServerManager(const std::string &service, const std::string &bind_host = "::", int backlog = 100);
 
+        /**
+        * Create server socket with `options` applied before bind (required for SO_REUSEPORT)
+        */
+        TcpServerManager(const std::string &service, const std::string &bind_host, int backlog,
+                         const SocketOptions &options);
+
+        /**
+        * Adopt already bound and listening socket `fd` (inherited or activated). Check errors after it
+        */
+        explicit TcpServerManager(int fd);
+
         static std::shared_ptr<TcpServerManager> create(const std::string &service, const std::string &bind_host = "::",
                                                         int backlog = 100);
 
+        /**
+        * Adopt listening socket. See TcpServerManager(int)
+        */
+        static std::shared_ptr<TcpServerManager> adopt(int fd);
+
+        /**
+         * Apply `options` to server socket and to every accepted client. Options are per server, so
+         * throughput oriented servers are not affected. Returns false on error
+         */
+        bool set_socket_options(const SocketOptions &options);
+
+        inline const SocketOptions &socket_options() const { return options_; }
+
+        /**
+         * Accept new client with configured socket options or returns -1 on error
+         */
+        virtual int next_descriptor() override;
+
+    private:
+        SocketOptions options_;
     };
 
 
@@ -302,16 +478,38 @@ namespace io {
         */
         UnixServerManager(const std::string &path, int backlog = 100, uint32_t mode = 0777);
 
+        /**
+        * Adopt already bound and listening UNIX socket `fd`. Socket file is not removed at the end
+        */
+        explicit UnixServerManager(int fd);
+
         inline const std::string &path() const { return path_; }
 
         static std::shared_ptr<UnixServerManager> create(const std::string &path, int backlog = 100,
                                                          uint32_t mode = 0777);
 
+        /**
+        * Adopt listening socket. See UnixServerManager(int)
+        */
+        static std::shared_ptr<UnixServerManager> adopt(int fd);
+
+        /**
+        * Remove socket file in destructor (default for created servers). It is skipped automatically
+        * when socket was handed over by spawn_with_listeners; disable it for other ways of handover.
+        * File is never removed if it was re-bound by someone else
+        */
+        inline void set_remove_on_close(bool enable) { remove_on_close_ = enable; }
+
+        inline bool remove_on_close() const { return remove_on_close_; }
+
 
         virtual ~UnixServerManager();
 
     private:
         std::string path_;
+        bool remove_on_close_ = true;
+        dev_t device_ = 0; // Identity of socket file created by this server
+        ino_t inode_ = 0;
     };
 
     /**
@@ -343,6 +541,59 @@ namespace io {
          */
         static Ptr create(int fd);
 
+        /**
+         * Switch O_NONBLOCK of descriptor. Returns false on error
+         */
+        bool set_non_blocking(bool enable);
+
+        /**
+         * Input or output stopped because descriptor is not ready (EAGAIN), not because of EOF or error
+         */
+        inline bool input_would_block() const { return input_buffer.would_block(); }
+
+        inline bool output_would_block() const { return output_buffer.would_block(); }
+
+        /**
+         * Bytes of output not yet accepted by descriptor. Wait for EPOLLOUT and flush() while non zero
+         */
+        inline std::size_t output_pending() const { return output_buffer.pending(); }
+
+        /**
+         * Re-arm streams after readiness notification: clear state of stream which stopped only because
+         * descriptor would block. Streams stopped by real EOF or error keep their state.
+         * Standard streams set eofbit/badbit on any buffer failure, so call it before next read or write
+         */
+        void rearm();
+
+        /**
+         * Bytes of input read from descriptor but not consumed yet
+         */
+        inline std::size_t input_buffered() const { return input_buffer.buffered(); }
+
+        /**
+         * Bytes held by input and output buffers
+         */
+        inline std::size_t memory_usage() const {
+            return input_buffer.memory_usage() + output_buffer.memory_usage();
+        }
+
+        /**
+         * Release buffers without data (for idle connections). Not safe concurrently with reading or writing
+         * of same buffer. Returns count of released bytes
+         */
+        std::size_t shrink(bool input = true, bool output = true);
+
+        /**
+         * Close descriptor. Buffers stop using it too
+         */
+        virtual void close() override;
+
+        /**
+         * Close connection but keep descriptor number reserved (it points to /dev/null) until stream is
+         * destroyed, so threads still holding the stream never write to a reused descriptor
+         */
+        void hangup();
+
     private:
         FileReadBuffer input_buffer;
         FileWriteBuffer output_buffer;
@@ -0,0 +1,334 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+#include "journal.h"
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <system_error>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace io {
+
+    static const char *const NextSegment = ".next";
+
+    static std::string segment_path(const std::string &directory, uint64_t base) {
+        char name[32];
+        snprintf(name, sizeof(name), "%020" PRIu64 ".log", base);
+        return directory + "/" + name;
+    }
+
+    /**
+     * Sorted bases of segments in directory
+     */
+    static std::vector<uint64_t> list_segments(const std::string &directory) {
+        std::vector<uint64_t> bases;
+        DIR *dir = opendir(directory.c_str());
+        if (dir == nullptr) return bases;
+        while (struct dirent *entry = readdir(dir)) {
+            std::string name(entry->d_name);
+            if (name.size() != 24 || name.compare(20, 4, ".log") != 0) continue;
+            if (!std::all_of(name.begin(), name.begin() + 20, ::isdigit)) continue;
+            bases.push_back(strtoull(name.c_str(), nullptr, 10));
+        }
+        closedir(dir);
+        std::sort(bases.begin(), bases.end());
+        return bases;
+    }
+
+    static bool sync_directory(const std::string &directory) {
+        int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) return false;
+        bool done = fsync(fd) == 0;
+        ::close(fd);
+        return done;
+    }
+
+    static int open_segment_file(const std::string &path, size_t preallocate) {
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) return -1;
+        if (preallocate > 0 && fallocate(fd, 0, 0, static_cast<off_t>(preallocate)) != 0 &&
+            errno != EOPNOTSUPP) {
+            int error = errno;
+            ::close(fd);
+            errno = error;
+            return -1;
+        }
+        return fd;
+    }
+
+    /**
+     * Checksum stored in header. Mark makes zero filled space invalid even as empty record
+     */
+    static uint32_t record_checksum(const void *data, size_t size) {
+        return crc32(data, size) ^ 0x9E3779B9u;
+    }
+
+    uint32_t crc32(const void *data, size_t size, uint32_t crc) {
+        struct Table {
+            uint32_t values[256];
+
+            Table() {
+                for (uint32_t i = 0; i < 256; ++i) {
+                    uint32_t c = i;
+                    for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                    values[i] = c;
+                }
+            }
+        };
+        static const Table table;
+        const unsigned char *ptr = static_cast<const unsigned char *>(data);
+        crc = ~crc;
+        for (size_t i = 0; i < size; ++i) crc = table.values[(crc ^ ptr[i]) & 0xFF] ^ (crc >> 8);
+        return ~crc;
+    }
+
+    LogWriter::LogWriter(const std::string &directory, size_t segment_size, size_t max_pending)
+            : directory_(directory), segment_size_(segment_size), max_pending_(max_pending > 0 ? max_pending : 1),
+              durable_(0) {
+        if (mkdir(directory_.c_str(), 0755) != 0 && errno != EEXIST) {
+            set_error();
+            return;
+        }
+        if (!recover()) {
+            set_error();
+            return;
+        }
+        worker_ = std::thread(&LogWriter::run, this);
+    }
+
+    LogWriter::~LogWriter() {
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        space_.notify_all();
+        if (worker_.joinable()) worker_.join();
+        if (current_.fd >= 0) ::close(current_.fd);
+        if (next_.fd >= 0) {
+            ::close(next_.fd);
+            unlink((directory_ + "/" + NextSegment).c_str());
+        }
+    }
+
+    bool LogWriter::recover() {
+        unlink((directory_ + "/" + NextSegment).c_str()); // Not finished preallocation
+        std::vector<uint64_t> bases = list_segments(directory_);
+        uint64_t base = bases.empty() ? 0 : bases.back();
+        uint64_t end = base;
+        if (!bases.empty()) {
+            LogReader reader(directory_, base);
+            std::string record;
+            while (reader.next(record));
+            end = reader.offset();
+        }
+        std::string path = segment_path(directory_, base);
+        current_.fd = open_segment_file(path, bases.empty() ? segment_size_ : 0);
+        if (current_.fd < 0) return false;
+        current_.base = base;
+        if (bases.empty()) sync_directory(directory_);
+        tail_base_ = base;
+        tail_position_ = end - base;
+        durable_.store(end, std::memory_order_release);
+        return true;
+    }
+
+    int64_t LogWriter::append(const void *data, size_t size, const Completion &done) {
+        std::unique_lock<std::mutex> lock(lock_);
+        while (!stop_ && failure_ == 0 && pending_bytes_ >= max_pending_) space_.wait(lock);
+        if (stop_ || failure_ != 0 || current_.fd < 0 || size > UINT32_MAX) return -1;
+        size_t record = HeaderSize + size;
+        if (tail_position_ > 0 && tail_position_ + record > segment_size_) { // Roll, rest of segment stays zero
+            tail_base_ += tail_position_;
+            tail_position_ = 0;
+        }
+        if (pending_.empty() || pending_.back().base != tail_base_)
+            pending_.push_back(Chunk{tail_base_, tail_position_, std::string()});
+        uint32_t header[2] = {static_cast<uint32_t>(size), record_checksum(data, size)};
+        std::string &batch = pending_.back().data;
+        batch.append(reinterpret_cast<const char *>(header), HeaderSize);
+        batch.append(static_cast<const char *>(data), size);
+        uint64_t offset = tail_base_ + tail_position_;
+        tail_position_ += record;
+        pending_bytes_ += record;
+        if (done) waiters_.push_back(Waiter{offset, done});
+        lock.unlock();
+        wake_.notify_one();
+        return static_cast<int64_t>(offset);
+    }
+
+    std::future<uint64_t> LogWriter::append(const std::string &data) {
+        auto promise = std::make_shared<std::promise<uint64_t>>();
+        std::future<uint64_t> result = promise->get_future();
+        int64_t offset = append(data.data(), data.size(), [promise](int error, uint64_t offset) {
+            if (error == 0) promise->set_value(offset);
+            else promise->set_exception(std::make_exception_ptr(std::system_error(error, std::system_category())));
+        });
+        if (offset < 0)
+            promise->set_exception(std::make_exception_ptr(std::system_error(EBADF, std::system_category())));
+        return result;
+    }
+
+    bool LogWriter::sync() {
+        std::unique_lock<std::mutex> lock(lock_);
+        uint64_t target = tail_base_ + tail_position_;
+        while (failure_ == 0 && durable_.load(std::memory_order_acquire) < target && worker_.joinable())
+            synced_.wait(lock);
+        return failure_ == 0;
+    }
+
+    uint64_t LogWriter::end_offset() {
+        std::lock_guard<std::mutex> guard(lock_);
+        return tail_base_ + tail_position_;
+    }
+
+    void LogWriter::run() {
+        std::vector<Chunk> chunks;
+        std::vector<Waiter> waiters;
+        while (true) {
+            uint64_t end;
+            int error;
+            {
+                std::unique_lock<std::mutex> lock(lock_);
+                while (!stop_ && pending_.empty()) wake_.wait(lock);
+                if (pending_.empty()) break;
+                chunks.swap(pending_);
+                waiters.swap(waiters_);
+                pending_bytes_ = 0;
+                end = tail_base_ + tail_position_;
+                error = failure_;
+            }
+            space_.notify_all();
+            if (error == 0) error = commit(chunks);
+            {
+                std::lock_guard<std::mutex> guard(lock_);
+                if (error != 0) failure_ = error;
+                else durable_.store(end, std::memory_order_release);
+            }
+            synced_.notify_all();
+            space_.notify_all();
+            for (auto &waiter:waiters) waiter.done(error, waiter.offset);
+            chunks.clear();
+            waiters.clear();
+            if (error == 0 && next_.fd < 0) prepare_next(); // Preallocate off the append path
+        }
+        synced_.notify_all();
+    }
+
+    bool LogWriter::prepare_next() {
+        next_.fd = open_segment_file(directory_ + "/" + NextSegment, segment_size_);
+        return next_.fd >= 0;
+    }
+
+    int LogWriter::roll(uint64_t base) {
+        if (fdatasync(current_.fd) != 0) return errno;
+        ::close(current_.fd);
+        std::string path = segment_path(directory_, base);
+        if (next_.fd >= 0 && rename((directory_ + "/" + NextSegment).c_str(), path.c_str()) == 0) {
+            current_.fd = next_.fd;
+            next_.fd = -1;
+        } else {
+            if (next_.fd >= 0) ::close(next_.fd);
+            next_.fd = -1;
+            current_.fd = open_segment_file(path, segment_size_);
+            if (current_.fd < 0) return errno;
+        }
+        current_.base = base;
+        if (!sync_directory(directory_)) return errno;
+        return 0;
+    }
+
+    int LogWriter::commit(std::vector<Chunk> &chunks) {
+        for (auto &chunk:chunks) {
+            if (chunk.base != current_.base) {
+                int error = roll(chunk.base);
+                if (error != 0) return error;
+            }
+            const char *data = chunk.data.data();
+            size_t left = chunk.data.size();
+            off_t position = static_cast<off_t>(chunk.position);
+            while (left > 0) {
+                ssize_t n = pwrite(current_.fd, data, left, position);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    return errno;
+                }
+                data += n;
+                left -= static_cast<size_t>(n);
+                position += n;
+            }
+        }
+        if (fdatasync(current_.fd) != 0) return errno;
+        return 0;
+    }
+
+    LogReader::LogReader(const std::string &directory, uint64_t offset) : directory_(directory) {
+        std::vector<uint64_t> bases = list_segments(directory_);
+        if (bases.empty()) return; // Nothing yet, will be opened by next()
+        auto it = std::upper_bound(bases.begin(), bases.end(), offset);
+        if (it != bases.begin()) --it;
+        position_ = 0;
+        if (!open_segment(*it)) {
+            set_error();
+            return;
+        }
+        std::string skipped;
+        while (this->offset() < offset && next(skipped));
+    }
+
+    bool LogReader::open_segment(uint64_t base) {
+        int fd = ::open(segment_path(directory_, base).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        lseek(fd, static_cast<off_t>(position_), SEEK_SET);
+        reader_.reset(new FileReadBuffer(fd));
+        reader_->set_auto_close(true);
+        base_ = base;
+        segment_end_ = 0;
+        return true;
+    }
+
+    bool LogReader::fits(uint32_t length) {
+        uint64_t end = position_ + LogWriter::HeaderSize + length;
+        if (end <= segment_end_) return true;
+        struct stat info;
+        if (fstat(reader_->descriptor(), &info) != 0) return false;
+        segment_end_ = static_cast<uint64_t>(info.st_size); // Writer may have extended segment since last check
+        return end <= segment_end_;
+    }
+
+    bool LogReader::next_segment() {
+        std::vector<uint64_t> bases = list_segments(directory_);
+        auto it = std::upper_bound(bases.begin(), bases.end(), base_);
+        if (it == bases.end()) return false;
+        position_ = 0;
+        return open_segment(*it);
+    }
+
+    bool LogReader::next(std::string &record, uint64_t *offset) {
+        if (!reader_) {
+            std::vector<uint64_t> bases = list_segments(directory_);
+            if (bases.empty() || !open_segment(bases.front())) return false;
+        }
+        uint32_t header[2];
+        if (reader_->sgetn(reinterpret_cast<char *>(header), LogWriter::HeaderSize) ==
+            static_cast<std::streamsize>(LogWriter::HeaderSize) &&
+            fits(header[0])) { // Length from torn or corrupt header isn't trusted for allocation
+            record.resize(header[0]);
+            if ((header[0] == 0 || reader_->sgetn(&record[0], header[0]) == static_cast<std::streamsize>(header[0])) &&
+                record_checksum(record.data(), record.size()) == header[1]) {
+                if (offset != nullptr) *offset = base_ + position_;
+                position_ += LogWriter::HeaderSize + header[0];
+                return true;
+            }
+        }
+        // End of valid data in segment: continue in next one or rewind to retry later
+        if (next_segment()) return next(record, offset);
+        open_segment(base_);
+        return false;
+    }
+}
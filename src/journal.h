@@ -0,0 +1,173 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+#ifndef IO_JOURNAL_H
+#define IO_JOURNAL_H
+
+#include "io.h"
+#include <atomic>
+#include <cstdint>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace io {
+
+    /**
+     * Append-only log split to preallocated segment files in one directory.
+     * Segment file name is logical offset of its first record (20 digits) with `.log` suffix.
+     * Record: 4 bytes size, 4 bytes CRC32 of payload mixed with constant mark, payload. Preallocated tail
+     * is zero filled and zero header never matches (even for empty record), so first checksum mismatch
+     * marks end of log.
+     *
+     * Appends from any thread are copied to pending batch; background thread writes whole batch
+     * with one write and one fdatasync (group commit), rolls segments and preallocates next one.
+     */
+    struct LogWriter : public WithError {
+        /**
+         * Durability notification: error code (0 or errno) and logical offset of record.
+         * Called in background thread after record (and everything before it) is on disk
+         */
+        using Completion = std::function<void(int, uint64_t)>;
+
+        /**
+         * Open (or create) log in `directory` and start background thread. Check errors after it.
+         * Existing log is scanned and appending continues after last valid record.
+         * `max_pending` bytes of not written data block appenders (backpressure)
+         */
+        explicit LogWriter(const std::string &directory, size_t segment_size = 64 * 1024 * 1024,
+                           size_t max_pending = 16 * 1024 * 1024);
+
+        /**
+         * Flush pending records and stop background thread
+         */
+        ~LogWriter();
+
+        /**
+         * Append record. Thread safe. Returns logical offset of record or -1 if log is closed or failed
+         */
+        int64_t append(const void *data, size_t size, const Completion &done = nullptr);
+
+        /**
+         * Append record. Future is ready with record offset when it's durable or holds std::system_error
+         */
+        std::future<uint64_t> append(const std::string &data);
+
+        /**
+         * Wait until all appended records are durable. Returns false on write error
+         */
+        bool sync();
+
+        /**
+         * Offset after last durable record
+         */
+        inline uint64_t durable_offset() const { return durable_.load(std::memory_order_acquire); }
+
+        /**
+         * Offset after last appended record
+         */
+        uint64_t end_offset();
+
+        inline const std::string &directory() const { return directory_; }
+
+        inline size_t segment_size() const { return segment_size_; }
+
+        /**
+         * Size of record header
+         */
+        static constexpr size_t HeaderSize = 8;
+
+    private:
+        struct Chunk {
+            uint64_t base;      // Segment of chunk
+            uint64_t position;  // Position in segment
+            std::string data;
+        };
+
+        struct Waiter {
+            uint64_t offset;
+            Completion done;
+        };
+
+        struct Segment {
+            int fd = -1;
+            uint64_t base = 0;
+        };
+
+        LogWriter(const LogWriter &) = delete;
+
+        LogWriter &operator=(const LogWriter &) = delete;
+
+        bool recover();
+
+        bool prepare_next();
+
+        int roll(uint64_t base);
+
+        void run();
+
+        int commit(std::vector<Chunk> &chunks);
+
+        std::string directory_;
+        size_t segment_size_;
+        size_t max_pending_;
+
+        std::mutex lock_;
+        std::condition_variable wake_, space_, synced_;
+        std::vector<Chunk> pending_;
+        std::vector<Waiter> waiters_;
+        size_t pending_bytes_ = 0;
+        uint64_t tail_base_ = 0, tail_position_ = 0; // Where next record goes
+        bool stop_ = false;
+        int failure_ = 0;
+
+        std::atomic<uint64_t> durable_;
+        Segment current_, next_;
+        std::thread worker_;
+    };
+
+    /**
+     * Sequential reader of log written by LogWriter. Stops at end of valid data and can continue
+     * after writer appended more records
+     */
+    struct LogReader : public WithError {
+        /**
+         * Read log in `directory` starting from record at logical `offset`. Check errors after it
+         */
+        explicit LogReader(const std::string &directory, uint64_t offset = 0);
+
+        /**
+         * Read next record. Returns false at end of log (or on error)
+         */
+        bool next(std::string &record, uint64_t *offset = nullptr);
+
+        /**
+         * Logical offset of next record
+         */
+        inline uint64_t offset() const { return base_ + position_; }
+
+    private:
+        bool open_segment(uint64_t base);
+
+        bool next_segment();
+
+        /**
+         * Check that record of `length` bytes ends inside current segment
+         */
+        bool fits(uint32_t length);
+
+        std::string directory_;
+        std::unique_ptr<FileReadBuffer> reader_;
+        uint64_t base_ = 0, position_ = 0, segment_end_ = 0; // Known size of current segment file
+    };
+
+    /**
+     * CRC32 (IEEE) of data
+     */
+    uint32_t crc32(const void *data, size_t size, uint32_t crc = 0);
+}
+#endif //IO_JOURNAL_H
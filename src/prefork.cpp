@@ -0,0 +1,281 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+#include "prefork.h"
+#include "async.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <chrono>
+#include <thread>
+
+namespace io {
+
+    bool send_descriptor(int channel, int fd) {
+        char byte = 0;
+        iovec data = {&byte, 1};
+        union {
+            char buffer[CMSG_SPACE(sizeof(int))];
+            cmsghdr align;
+        } control;
+        msghdr message;
+        memset(&message, 0, sizeof(message));
+        memset(&control, 0, sizeof(control));
+        message.msg_iov = &data;
+        message.msg_iovlen = 1;
+        message.msg_control = control.buffer;
+        message.msg_controllen = sizeof(control.buffer);
+        cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(header), &fd, sizeof(int));
+        ssize_t n;
+        do {
+            n = sendmsg(channel, &message, MSG_NOSIGNAL);
+        } while (n < 0 && errno == EINTR);
+        return n == 1;
+    }
+
+    int receive_descriptor(int channel) {
+        char byte;
+        iovec data = {&byte, 1};
+        union {
+            char buffer[CMSG_SPACE(sizeof(int))];
+            cmsghdr align;
+        } control;
+        msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = &data;
+        message.msg_iovlen = 1;
+        message.msg_control = control.buffer;
+        message.msg_controllen = sizeof(control.buffer);
+        ssize_t n;
+        do {
+            n = recvmsg(channel, &message, MSG_CMSG_CLOEXEC);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) return -1;
+        cmsghdr *header = CMSG_FIRSTHDR(&message);
+        if (header == nullptr || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) return -1;
+        int fd;
+        memcpy(&fd, CMSG_DATA(header), sizeof(int));
+        return fd;
+    }
+
+    DescriptorReceiver::DescriptorReceiver(int channel) {
+        descriptor_ = channel;
+        set_auto_close(true);
+    }
+
+    int DescriptorReceiver::next_descriptor() {
+        if (!is_active()) return -1;
+        int fd = receive_descriptor(descriptor_);
+        if (fd < 0) set_error();
+        return fd;
+    }
+
+    void DescriptorReceiver::on_descriptor_closed(int) {
+        if (!is_active()) return;
+        char released = 1;
+        ssize_t n;
+        do {
+            n = send(descriptor_, &released, 1, MSG_NOSIGNAL);
+        } while (n < 0 && errno == EINTR);
+    }
+
+    PreforkMaster::PreforkMaster(Epoll &epoll, ConnectionManager::Ptr listener, size_t workers,
+                                 const WorkerMain &main) : epoll_(epoll), listener_(listener), main_(main),
+                                                           workers_(workers > 0 ? workers : 1) {
+        if (!listener_ || !listener_->has_valid_descriptor()) {
+            set_error(EBADF, "listener is not active");
+            return;
+        }
+        running_ = true;
+        for (size_t i = 0; i < workers_.size(); ++i) {
+            if (!spawn(i)) {
+                set_error();
+                stop();
+                return;
+            }
+        }
+        if (!epoll_.add<PreforkMaster, &PreforkMaster::on_accept>(listener_->descriptor(), EPOLLIN, this)) {
+            set_error();
+            stop();
+        }
+    }
+
+    PreforkMaster::~PreforkMaster() {
+        stop();
+        if (reap_timer_fd_ >= 0) {
+            epoll_.remove(reap_timer_fd_);
+            ::close(reap_timer_fd_);
+        }
+    }
+
+    void PreforkMaster::stop(int signal, uint64_t timeout) {
+        if (running_ && listener_) epoll_.remove(listener_->descriptor());
+        running_ = false;
+        for (size_t i = 0; i < workers_.size(); ++i) {
+            if (workers_[i].pid > 0) kill(workers_[i].pid, signal);
+            release(i);
+        }
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+        while (!reap()) {
+            auto now = std::chrono::steady_clock::now();
+            if (now >= deadline) { // Escalate: SIGKILL can't be ignored, so blocking wait is bounded
+                for (auto &process:exiting_) kill(process.pid, SIGKILL);
+                for (auto &process:exiting_) {
+                    while (waitpid(process.pid, nullptr, 0) < 0 && errno == EINTR);
+                    if (process.pidfd >= 0) {
+                        epoll_.remove(process.pidfd);
+                        ::close(process.pidfd);
+                    }
+                }
+                exiting_.clear();
+                break;
+            }
+            int wait = static_cast<int>(std::min<int64_t>(
+                    std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count() + 1, 10));
+            std::vector<pollfd> fds;
+            for (auto &process:exiting_) if (process.pidfd >= 0) fds.push_back({process.pidfd, POLLIN, 0});
+            if (fds.size() == exiting_.size()) poll(fds.data(), fds.size(), wait);
+            else std::this_thread::sleep_for(std::chrono::milliseconds(wait));
+        }
+    }
+
+    bool PreforkMaster::spawn(size_t index) {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) != 0) return false;
+        pid_t pid = fork();
+        if (pid < 0) {
+            ::close(pair[0]);
+            ::close(pair[1]);
+            return false;
+        }
+        if (pid == 0) { // Worker: drop master resources without running destructors
+            ::close(pair[0]);
+            ::close(listener_->descriptor());
+            for (auto &worker:workers_)
+                if (worker.channel >= 0) ::close(worker.channel);
+            for (auto &process:exiting_)
+                if (process.pidfd >= 0) ::close(process.pidfd);
+            if (reap_timer_fd_ >= 0) ::close(reap_timer_fd_);
+            int code = main_(std::make_shared<DescriptorReceiver>(pair[1]));
+            _exit(code);
+        }
+        ::close(pair[1]);
+        fcntl(pair[0], F_SETFL, fcntl(pair[0], F_GETFL) | O_NONBLOCK);
+        Worker &worker = workers_[index];
+        worker.pid = pid;
+        worker.channel = pair[0];
+        worker.load = 0;
+        if (!epoll_.add<PreforkMaster, &PreforkMaster::on_channel>(pair[0], EPOLLIN | EPOLLHUP | EPOLLRDHUP, this)) {
+            kill(pid, SIGTERM);
+            release(index);
+            return false;
+        }
+        return true;
+    }
+
+    void PreforkMaster::release(size_t index) {
+        Worker &worker = workers_[index];
+        if (worker.channel >= 0) {
+            epoll_.remove(worker.channel);
+            ::close(worker.channel);
+            worker.channel = -1;
+        }
+        if (worker.pid > 0) {
+            if (waitpid(worker.pid, nullptr, WNOHANG) == 0) { // Still running: reap when it exits
+                int pidfd = -1;
+#ifdef SYS_pidfd_open
+                pidfd = static_cast<int>(syscall(SYS_pidfd_open, worker.pid, 0));
+                if (pidfd >= 0 && !epoll_.add<PreforkMaster, &PreforkMaster::on_exited>(pidfd, EPOLLIN, this)) {
+                    ::close(pidfd);
+                    pidfd = -1;
+                }
+#endif
+                if (pidfd < 0 && reap_timer_fd_ < 0) {
+                    reap_timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+                    if (reap_timer_fd_ >= 0 &&
+                        !epoll_.add<PreforkMaster, &PreforkMaster::on_exited>(reap_timer_fd_, EPOLLIN, this)) {
+                        ::close(reap_timer_fd_);
+                        reap_timer_fd_ = -1;
+                    }
+                }
+                if (pidfd < 0 && reap_timer_fd_ >= 0) { // Poll every 100ms until all are reaped
+                    itimerspec spec = {};
+                    spec.it_value.tv_nsec = spec.it_interval.tv_nsec = 100000000L;
+                    timerfd_settime(reap_timer_fd_, 0, &spec, nullptr);
+                }
+                exiting_.push_back({worker.pid, pidfd});
+            }
+            worker.pid = -1;
+        }
+        worker.load = 0;
+    }
+
+    bool PreforkMaster::reap() {
+        size_t kept = 0;
+        for (auto &process:exiting_) {
+            pid_t result = waitpid(process.pid, nullptr, WNOHANG);
+            if (result == 0 || (result < 0 && errno == EINTR)) {
+                exiting_[kept++] = process;
+            } else if (process.pidfd >= 0) {
+                epoll_.remove(process.pidfd);
+                ::close(process.pidfd);
+            }
+        }
+        exiting_.resize(kept);
+        return exiting_.empty();
+    }
+
+    void PreforkMaster::on_exited(Epoll &, uint32_t, int fd) {
+        if (fd == reap_timer_fd_) {
+            uint64_t expirations;
+            while (read(fd, &expirations, sizeof(expirations)) > 0);
+        }
+        if (reap() && reap_timer_fd_ >= 0) {
+            itimerspec spec = {};
+            timerfd_settime(reap_timer_fd_, 0, &spec, nullptr);
+        }
+    }
+
+    void PreforkMaster::on_accept(Epoll &, uint32_t, int) {
+        int client = listener_->next_descriptor();
+        if (client < 0) return;
+        std::vector<size_t> order; // Least loaded first, skip broken workers
+        for (size_t i = 0; i < workers_.size(); ++i) if (workers_[i].channel >= 0) order.push_back(i);
+        std::sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+            return workers_[a].load < workers_[b].load;
+        });
+        for (size_t index:order) {
+            if (send_descriptor(workers_[index].channel, client)) {
+                ++workers_[index].load;
+                break;
+            }
+        }
+        ::close(client); // Worker has own copy
+        listener_->on_descriptor_closed(client);
+    }
+
+    void PreforkMaster::on_channel(Epoll &, uint32_t events, int fd) {
+        size_t index = 0;
+        while (index < workers_.size() && workers_[index].channel != fd) ++index;
+        if (index == workers_.size()) return;
+        Worker &worker = workers_[index];
+        char released[64];
+        ssize_t n;
+        while ((n = recv(fd, released, sizeof(released), 0)) > 0) // One message per closed client
+            if (worker.load > 0) --worker.load;
+        if (n == 0 || (events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR))) { // Worker exited
+            release(index);
+            if (running_ && !spawn(index)) set_error();
+        }
+    }
+}
@@ -0,0 +1,140 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+#ifndef IO_PREFORK_H
+#define IO_PREFORK_H
+
+#include "io.h"
+#include <functional>
+#include <csignal>
+#include <sys/types.h>
+
+namespace io {
+    struct Epoll;
+
+    /**
+     * Send descriptor `fd` over Unix socket `channel` (SCM_RIGHTS). Sender still owns its copy.
+     * Returns false on error
+     */
+    bool send_descriptor(int channel, int fd);
+
+    /**
+     * Receive descriptor sent by send_descriptor. Returns -1 on error or closed channel
+     */
+    int receive_descriptor(int channel);
+
+    /**
+     * Connection manager of pre-forked worker: yields client descriptors received from PreforkMaster
+     * and reports closed ones back for least-loaded dispatch
+     */
+    struct DescriptorReceiver : public ConnectionManager {
+        typedef std::shared_ptr<DescriptorReceiver> Ptr;
+
+        /**
+         * Use (and close at end) worker side of channel
+         */
+        explicit DescriptorReceiver(int channel);
+
+        virtual inline bool is_active() override { return has_valid_descriptor(); }
+
+        /**
+         * Receive next client descriptor or returns -1 when master is gone
+         */
+        virtual int next_descriptor() override;
+
+        /**
+         * Report closed client to master
+         */
+        virtual void on_descriptor_closed(int fd) override;
+    };
+
+    /**
+     * Master of pre-forked workers. Accepts clients in master process and passes them over Unix sockets
+     * to the worker with the least count of open clients. Every worker runs `main` in forked process
+     * (usually own Epoll with AsyncSocketServer over received DescriptorReceiver) and exits with its result.
+     * Died workers are restarted while master is running.
+     */
+    struct PreforkMaster : public WithError {
+        /**
+         * Worker entry point. Executed in child process, return value is exit code
+         */
+        using WorkerMain = std::function<int(DescriptorReceiver::Ptr)>;
+
+        /**
+         * Fork `workers` processes and register `listener` in `epoll`. Check errors after it
+         */
+        PreforkMaster(Epoll &epoll, ConnectionManager::Ptr listener, size_t workers, const WorkerMain &main);
+
+        /**
+         * Stop workers
+         */
+        ~PreforkMaster();
+
+        /**
+         * Stop accepting, send `signal` to workers and wait them. Workers still running after `timeout`
+         * milliseconds are killed with SIGKILL
+         */
+        void stop(int signal = SIGTERM, uint64_t timeout = 5000);
+
+        inline bool running() const { return running_; }
+
+        /**
+         * Count of workers
+         */
+        inline size_t workers() const { return workers_.size(); }
+
+        /**
+         * Process id of worker `index` or -1
+         */
+        inline pid_t worker_pid(size_t index) const { return workers_[index].pid; }
+
+        /**
+         * Count of clients passed to worker `index` and not closed yet
+         */
+        inline size_t worker_load(size_t index) const { return workers_[index].load; }
+
+    private:
+        struct Worker {
+            pid_t pid = -1;
+            int channel = -1; // Master side
+            size_t load = 0;
+        };
+
+        PreforkMaster(const PreforkMaster &) = delete;
+
+        PreforkMaster &operator=(const PreforkMaster &) = delete;
+
+        struct Exiting {
+            pid_t pid;
+            int pidfd; // Readable when process exits, -1 if pidfd_open is not supported
+        };
+
+        bool spawn(size_t index);
+
+        /**
+         * Close channel of worker and reap it without blocking. Not exited process is reaped later
+         */
+        void release(size_t index);
+
+        /**
+         * Reap exited processes (WNOHANG). Returns true if none left
+         */
+        bool reap();
+
+        void on_accept(Epoll &, uint32_t events, int fd);
+
+        void on_channel(Epoll &, uint32_t events, int fd);
+
+        void on_exited(Epoll &, uint32_t events, int fd);
+
+        Epoll &epoll_;
+        ConnectionManager::Ptr listener_;
+        WorkerMain main_;
+        std::vector<Worker> workers_;
+        std::vector<Exiting> exiting_;
+        int reap_timer_fd_ = -1; // Polls exited workers when pidfd is not available
+        bool running_ = false;
+    };
+}
+#endif //IO_PREFORK_H
@@ -0,0 +1,112 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+#include "readahead.h"
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace io {
+
+    ReadAheadBuffer::ReadAheadBuffer(int d, std::size_t chunk_size, std::size_t buffers)
+            : blocks_(buffers < 2 ? 2 : buffers) {
+        descriptor_ = d;
+        for (auto &block:blocks_) block.data.resize(chunk_size > 0 ? chunk_size : 1);
+        stop_event_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        worker_ = std::thread(&ReadAheadBuffer::run, this);
+    }
+
+    ReadAheadBuffer::~ReadAheadBuffer() {
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            stop_ = true;
+        }
+        free_cv_.notify_all();
+        if (stop_event_ >= 0) {
+            uint64_t one = 1;
+            ssize_t n = write(stop_event_, &one, sizeof(one));
+            (void) n;
+        }
+        if (worker_.joinable()) worker_.join();
+        if (stop_event_ >= 0) ::close(stop_event_);
+    }
+
+    int ReadAheadBuffer::error_code() const {
+        std::lock_guard<std::mutex> guard(lock_);
+        return error_;
+    }
+
+    std::streambuf::int_type ReadAheadBuffer::underflow() {
+        if (gptr() < egptr())  // buffer not exhausted
+            return traits_type::to_int_type(*gptr());
+        std::unique_lock<std::mutex> lock(lock_);
+        if (finished_) return traits_type::eof();
+        if (holding_) { // Give consumed block back to helper
+            head_ = (head_ + 1) % blocks_.size();
+            --filled_;
+            holding_ = false;
+            free_cv_.notify_one();
+        }
+        while (filled_ == 0) filled_cv_.wait(lock);
+        Block &block = blocks_[head_];
+        holding_ = true;
+        if (block.size == 0) { // EOF or error marker
+            finished_ = true;
+            setg(nullptr, nullptr, nullptr);
+            return traits_type::eof();
+        }
+        char *base = &block.data.front();
+        setg(base, base, base + block.size);
+        return traits_type::to_int_type(*gptr());
+    }
+
+    void ReadAheadBuffer::run() {
+        struct stat info;
+        bool regular = has_valid_descriptor() && fstat(descriptor_, &info) == 0 && S_ISREG(info.st_mode);
+        while (true) {
+            size_t index;
+            {
+                std::unique_lock<std::mutex> lock(lock_);
+                while (!stop_ && filled_ == blocks_.size()) free_cv_.wait(lock);
+                if (stop_) return;
+                index = tail_;
+            }
+            Block &block = blocks_[index]; // Owned by helper until published
+            ssize_t n = -1;
+            int error = has_valid_descriptor() ? 0 : EBADF;
+            while (error == 0) {
+                if (!regular) { // Wait for data or stop request
+                    pollfd fds[2] = {{descriptor_, POLLIN, 0},
+                                     {stop_event_, POLLIN, 0}};
+                    // Without eventfd nothing interrupts the wait: check stop flag periodically
+                    int ready = poll(fds, stop_event_ >= 0 ? 2 : 1, stop_event_ >= 0 ? -1 : 100);
+                    if (ready < 0) {
+                        if (errno == EINTR) continue;
+                        error = errno;
+                        break;
+                    }
+                    if (stop_event_ >= 0 && (fds[1].revents & POLLIN)) return;
+                    if (stop_event_ < 0) {
+                        std::lock_guard<std::mutex> guard(lock_);
+                        if (stop_) return;
+                    }
+                    if (ready == 0) continue;
+                }
+                n = read(descriptor_, &block.data.front(), block.data.size());
+                if (n >= 0) break;
+                if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) error = errno;
+            }
+            std::lock_guard<std::mutex> guard(lock_);
+            block.size = n > 0 ? static_cast<size_t>(n) : 0;
+            tail_ = (tail_ + 1) % blocks_.size();
+            ++filled_;
+            filled_cv_.notify_one();
+            if (block.size == 0) {
+                error_ = error;
+                return;
+            }
+        }
+    }
+}
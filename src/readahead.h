@@ -0,0 +1,62 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+#ifndef IO_READAHEAD_H
+#define IO_READAHEAD_H
+
+#include "io.h"
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace io {
+
+    /**
+     * Reader from file descriptor with read-ahead: helper thread fills next buffers while consumer parses
+     * current one, so sequential throughput approaches max(CPU, disk) instead of their sum.
+     * Works with regular files, pipes and sockets (blocking or not). Reading stops at first EOF or error.
+     * This class doesn't close descriptor automatically
+     */
+    struct ReadAheadBuffer : public std::streambuf, public Storage {
+
+        /**
+         * Start helper thread for descriptor `d` with `buffers` (at least 2) of `chunk_size` bytes
+         */
+        explicit ReadAheadBuffer(int d, std::size_t chunk_size = 1024 * 1024, std::size_t buffers = 2);
+
+        /**
+         * Stop helper thread. Blocked read of pipe or socket is interrupted
+         */
+        ~ReadAheadBuffer();
+
+        /**
+         * Error code (errno) of reading or 0 on clean EOF
+         */
+        int error_code() const;
+
+    private:
+        struct Block {
+            std::vector<char> data;
+            size_t size = 0;
+        };
+
+        int_type underflow();
+
+        void run();
+
+        ReadAheadBuffer(const ReadAheadBuffer &) = delete;
+
+        ReadAheadBuffer &operator=(const ReadAheadBuffer &) = delete;
+
+        std::vector<Block> blocks_;
+        size_t head_ = 0, tail_ = 0, filled_ = 0; // Filled blocks include one which is consumed now
+        bool holding_ = false, stop_ = false, finished_ = false;
+        int error_ = 0;
+        int stop_event_ = -1; // Interrupts waiting for pipe or socket, polled with timeout if not created
+        mutable std::mutex lock_;
+        std::condition_variable filled_cv_, free_cv_;
+        std::thread worker_;
+    };
+}
+#endif //IO_READAHEAD_H
@@ -0,0 +1,188 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+#include "registry.h"
+#include <cstdint>
+
+namespace io {
+
+    /**
+     * Slot of current thread in Epoch domain. Released on thread exit
+     */
+    struct ThreadSlot {
+        Epoch::Slot *slot = nullptr;
+        size_t nesting = 0;
+        bool overflow = false; // Section counted in Epoch::overflow_ because all slots were taken
+
+        ~ThreadSlot() {
+            if (slot != nullptr) {
+                slot->epoch.store(0, std::memory_order_release);
+                slot->used.store(false, std::memory_order_release);
+            }
+        }
+    };
+
+    static thread_local ThreadSlot thread_slot;
+
+    Epoch::Epoch() : global_(1), overflow_(0) {
+        for (auto &slot:slots_) {
+            slot.epoch.store(0, std::memory_order_relaxed);
+            slot.used.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    Epoch &Epoch::instance() {
+        static Epoch epoch;
+        return epoch;
+    }
+
+    Epoch::Guard::Guard() { Epoch::instance().enter(); }
+
+    Epoch::Guard::~Guard() { Epoch::instance().leave(); }
+
+    void Epoch::enter() {
+        ThreadSlot &local = thread_slot;
+        if (local.nesting++ > 0) return;
+        if (local.slot == nullptr) { // First use in thread: occupy free slot
+            for (auto &slot:slots_) {
+                bool expected = false;
+                if (!slot.used.load(std::memory_order_relaxed) &&
+                    slot.used.compare_exchange_strong(expected, true, std::memory_order_acq_rel)) {
+                    local.slot = &slot;
+                    break;
+                }
+            }
+        }
+        if (local.slot == nullptr) { // More threads than slots: hold back all reclamation instead of waiting
+            local.overflow = true;
+            overflow_.fetch_add(1, std::memory_order_seq_cst);
+        } else {
+            local.slot->epoch.store(global_.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    void Epoch::leave() {
+        ThreadSlot &local = thread_slot;
+        if (--local.nesting > 0) return;
+        if (local.overflow) {
+            local.overflow = false;
+            overflow_.fetch_sub(1, std::memory_order_release);
+        } else {
+            local.slot->epoch.store(0, std::memory_order_release);
+        }
+    }
+
+    void Epoch::retire(std::function<void()> deleter) {
+        bool full;
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            limbo_.emplace_back(global_.fetch_add(1, std::memory_order_seq_cst), std::move(deleter));
+            full = limbo_.size() >= 64;
+        }
+        if (full) collect();
+    }
+
+    void Epoch::collect() {
+        std::vector<std::function<void()>> ready;
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (overflow_.load(std::memory_order_seq_cst) > 0) return; // Readers without slot can see anything
+            uint64_t oldest = UINT64_MAX;
+            for (auto &slot:slots_) {
+                uint64_t epoch = slot.epoch.load(std::memory_order_seq_cst);
+                if (epoch != 0 && epoch < oldest) oldest = epoch;
+            }
+            size_t kept = 0;
+            for (auto &item:limbo_) {
+                if (item.first < oldest) ready.push_back(std::move(item.second));
+                else limbo_[kept++] = std::move(item);
+            }
+            limbo_.resize(kept);
+        }
+        for (auto &deleter:ready) deleter();
+    }
+
+    ClientRegistry::ClientRegistry() : size_(0) {
+        for (auto &chunk:chunks_) chunk.store(nullptr, std::memory_order_relaxed);
+    }
+
+    ClientRegistry::~ClientRegistry() {
+        clear();
+        for (auto &chunk:chunks_) delete[] chunk.load(std::memory_order_relaxed);
+        Epoch::instance().collect();
+    }
+
+    FileStream::Ptr ClientRegistry::find(int fd) const {
+        if (fd < 0 || static_cast<size_t>(fd) >= ChunkSize * MaxChunks) return nullptr;
+        Chunk *chunk = chunks_[fd >> ChunkBits].load(std::memory_order_acquire);
+        if (chunk == nullptr) return nullptr;
+        Epoch::Guard guard;
+        Entry *entry = (*chunk)[fd & (ChunkSize - 1)].load(std::memory_order_acquire);
+        return entry != nullptr ? entry->client : nullptr;
+    }
+
+    bool ClientRegistry::insert(int fd, const FileStream::Ptr &client) {
+        if (fd < 0 || static_cast<size_t>(fd) >= ChunkSize * MaxChunks || !client) return false;
+        std::lock_guard<std::mutex> guard(lock_);
+        Chunk *chunk = chunks_[fd >> ChunkBits].load(std::memory_order_relaxed);
+        if (chunk == nullptr) {
+            chunk = new Chunk[1];
+            for (size_t i = 0; i < ChunkSize; ++i) (*chunk)[i].store(nullptr, std::memory_order_relaxed);
+            chunks_[fd >> ChunkBits].store(chunk, std::memory_order_release);
+        }
+        Entry *previous = (*chunk)[fd & (ChunkSize - 1)].exchange(new Entry{client}, std::memory_order_acq_rel);
+        if (previous != nullptr) Epoch::instance().retire([previous]() { delete previous; });
+        else size_.fetch_add(1, std::memory_order_relaxed);
+        members_[fd] = client;
+        dirty_ = true;
+        snapshot_.reset(); // Removed clients keep descriptors open while referenced
+        return true;
+    }
+
+    FileStream::Ptr ClientRegistry::erase(int fd) {
+        if (fd < 0 || static_cast<size_t>(fd) >= ChunkSize * MaxChunks) return nullptr;
+        std::lock_guard<std::mutex> guard(lock_);
+        Chunk *chunk = chunks_[fd >> ChunkBits].load(std::memory_order_relaxed);
+        if (chunk == nullptr) return nullptr;
+        Entry *previous = (*chunk)[fd & (ChunkSize - 1)].exchange(nullptr, std::memory_order_acq_rel);
+        if (previous == nullptr) return nullptr;
+        FileStream::Ptr client = previous->client;
+        Epoch::instance().retire([previous]() { delete previous; });
+        size_.fetch_sub(1, std::memory_order_relaxed);
+        members_.erase(fd);
+        dirty_ = true;
+        snapshot_.reset(); // Removed clients keep descriptors open while referenced
+        return client;
+    }
+
+    std::vector<FileStream::Ptr> ClientRegistry::clear() {
+        std::vector<FileStream::Ptr> removed;
+        std::lock_guard<std::mutex> guard(lock_);
+        for (auto &kv:members_) {
+            Chunk *chunk = chunks_[kv.first >> ChunkBits].load(std::memory_order_relaxed);
+            Entry *previous = (*chunk)[kv.first & (ChunkSize - 1)].exchange(nullptr, std::memory_order_acq_rel);
+            if (previous != nullptr) Epoch::instance().retire([previous]() { delete previous; });
+            removed.push_back(kv.second);
+        }
+        members_.clear();
+        size_.store(0, std::memory_order_relaxed);
+        dirty_ = true;
+        snapshot_.reset(); // Removed clients keep descriptors open while referenced
+        return removed;
+    }
+
+    ClientRegistry::Snapshot ClientRegistry::snapshot() const {
+        std::lock_guard<std::mutex> guard(lock_);
+        if (dirty_) {
+            auto clients = std::make_shared<std::vector<FileStream::Ptr>>();
+            clients->reserve(members_.size());
+            for (auto &kv:members_) clients->push_back(kv.second);
+            snapshot_ = clients;
+            dirty_ = false;
+        }
+        return snapshot_;
+    }
+}
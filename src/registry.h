@@ -0,0 +1,150 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+#ifndef IO_REGISTRY_H
+#define IO_REGISTRY_H
+
+#include "io.h"
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace io {
+
+    /**
+     * Epoch based memory reclamation. Objects unlinked from lock-free structures are freed only
+     * after every reader which could see them left its critical section.
+     */
+    class Epoch {
+    public:
+        /**
+         * Process wide domain
+         */
+        static Epoch &instance();
+
+        /**
+         * Reader critical section. Nestable, lock-free and wait-free except first use in thread.
+         * Threads beyond MaxThreads don't get a slot and postpone reclamation while inside
+         */
+        struct Guard {
+            Guard();
+
+            ~Guard();
+
+        private:
+            Guard(const Guard &) = delete;
+
+            Guard &operator=(const Guard &) = delete;
+        };
+
+        /**
+         * Call `deleter` when no reader can access object unlinked before this call
+         */
+        void retire(std::function<void()> deleter);
+
+        /**
+         * Free all retired objects which are not visible to readers anymore
+         */
+        void collect();
+
+        enum : size_t {
+            MaxThreads = 256
+        };
+
+    private:
+        struct alignas(64) Slot {
+            std::atomic<uint64_t> epoch; // 0 - quiescent
+            std::atomic<bool> used;
+        };
+
+        Epoch();
+
+        Epoch(const Epoch &) = delete;
+
+        Epoch &operator=(const Epoch &) = delete;
+
+        void enter();
+
+        void leave();
+
+        Slot slots_[MaxThreads];
+        std::atomic<uint64_t> global_;
+        std::atomic<size_t> overflow_; // Readers in critical section without slot
+        std::mutex lock_;
+        std::vector<std::pair<uint64_t, std::function<void()>>> limbo_;
+
+        friend struct ThreadSlot;
+    };
+
+    /**
+     * Descriptor indexed table of clients. Lookups are lock-free (epoch protected),
+     * modifications are serialized. Broadcasts iterate immutable snapshots.
+     */
+    struct ClientRegistry {
+        typedef std::shared_ptr<const std::vector<FileStream::Ptr>> Snapshot;
+
+        ClientRegistry();
+
+        ~ClientRegistry();
+
+        /**
+         * Find client by descriptor or return null. Lock-free
+         */
+        FileStream::Ptr find(int fd) const;
+
+        /**
+         * Add or replace client with descriptor `fd`. Returns false for invalid descriptor
+         */
+        bool insert(int fd, const FileStream::Ptr &client);
+
+        /**
+         * Remove client. Returns removed client or null
+         */
+        FileStream::Ptr erase(int fd);
+
+        /**
+         * Remove all clients and return them
+         */
+        std::vector<FileStream::Ptr> clear();
+
+        /**
+         * Consistent list of clients at the moment of call. Rebuilt only after modifications
+         */
+        Snapshot snapshot() const;
+
+        /**
+         * Count of clients
+         */
+        inline size_t size() const { return size_.load(std::memory_order_relaxed); }
+
+        inline bool empty() const { return size() == 0; }
+
+    private:
+        struct Entry {
+            FileStream::Ptr client;
+        };
+
+        enum : size_t {
+            ChunkBits = 10,
+            ChunkSize = 1 << ChunkBits,
+            MaxChunks = 1024 // Up to 1M descriptors
+        };
+
+        typedef std::atomic<Entry *> Chunk[ChunkSize];
+
+        ClientRegistry(const ClientRegistry &) = delete;
+
+        ClientRegistry &operator=(const ClientRegistry &) = delete;
+
+        std::atomic<Chunk *> chunks_[MaxChunks];
+        std::atomic<size_t> size_;
+        mutable std::mutex lock_;
+        std::unordered_map<int, FileStream::Ptr> members_; // Writer side copy for snapshots
+        mutable Snapshot snapshot_;
+        mutable bool dirty_ = true;
+    };
+}
+#endif //IO_REGISTRY_H
@@ -0,0 +1,211 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+#include "relay.h"
+#include "async.h"
+#include <fcntl.h>
+#include <csignal>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace io {
+
+    PipePool &PipePool::shared() {
+        static PipePool pool;
+        return pool;
+    }
+
+    PipePool::~PipePool() {
+        for (auto &pipe:free_) {
+            ::close(pipe.first);
+            ::close(pipe.second);
+        }
+    }
+
+    void PipePool::set_pipe_size(size_t size) {
+        std::lock_guard<std::mutex> guard(lock_);
+        pipe_size_ = size;
+    }
+
+    bool PipePool::acquire(int pipe[2]) {
+        size_t size;
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            if (!free_.empty()) {
+                pipe[0] = free_.back().first;
+                pipe[1] = free_.back().second;
+                free_.pop_back();
+                return true;
+            }
+            size = pipe_size_;
+        }
+        if (pipe2(pipe, O_NONBLOCK | O_CLOEXEC) != 0) return false;
+        if (size > 0) fcntl(pipe[1], F_SETPIPE_SZ, static_cast<int>(size)); // Best effort, limited by pipe-max-size
+        return true;
+    }
+
+    void PipePool::release(int pipe[2], bool empty) {
+        if (pipe[0] < 0) return;
+        if (empty) {
+            std::lock_guard<std::mutex> guard(lock_);
+            free_.emplace_back(pipe[0], pipe[1]);
+        } else {
+            ::close(pipe[0]);
+            ::close(pipe[1]);
+        }
+        pipe[0] = pipe[1] = -1;
+    }
+
+    /**
+     * splice() has no MSG_NOSIGNAL: writing to reset socket raises SIGPIPE. Default action (terminate)
+     * is replaced by ignoring once, handlers installed by application are kept
+     */
+    static void ignore_sigpipe() {
+        static std::once_flag once;
+        std::call_once(once, []() {
+            struct sigaction action;
+            if (sigaction(SIGPIPE, nullptr, &action) == 0 && action.sa_handler == SIG_DFL &&
+                !(action.sa_flags & SA_SIGINFO))
+                signal(SIGPIPE, SIG_IGN);
+        });
+    }
+
+    Relay::Relay(Epoll &epoll, int first, int second, const Handler &done) : epoll_(epoll), first_(first),
+                                                                             second_(second), done_(done) {
+        ignore_sigpipe();
+        forward_.from = backward_.to = first;
+        forward_.to = backward_.from = second;
+        for (auto direction:{&forward_, &backward_}) {
+            if (!PipePool::shared().acquire(direction->pipe)) {
+                set_error();
+                close();
+                return;
+            }
+            int size = fcntl(direction->pipe[1], F_GETPIPE_SZ);
+            direction->capacity = size > 0 ? static_cast<size_t>(size) : 65536;
+        }
+        for (int fd:{first, second}) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        first_events_ = second_events_ = EPOLLIN;
+        if (!epoll_.add<Relay, &Relay::on_event>(first_, first_events_, this) ||
+            !epoll_.add<Relay, &Relay::on_event>(second_, second_events_, this)) {
+            set_error();
+            close();
+            return;
+        }
+        active_ = true;
+    }
+
+    Relay::Ptr Relay::create(Epoll &epoll, int first, int second, const Handler &done) {
+        return std::make_shared<Relay>(epoll, first, second, done);
+    }
+
+    Relay::~Relay() {
+        close();
+    }
+
+    void Relay::close() {
+        if (first_ >= 0) {
+            epoll_.remove(first_);
+            ::close(first_);
+            first_ = -1;
+        }
+        if (second_ >= 0) {
+            epoll_.remove(second_);
+            ::close(second_);
+            second_ = -1;
+        }
+        for (auto direction:{&forward_, &backward_}) {
+            PipePool::shared().release(direction->pipe, direction->buffered == 0);
+            direction->from = direction->to = -1;
+        }
+        active_ = false;
+    }
+
+    void Relay::on_event(Epoll &, uint32_t events, int fd) {
+        if (!active_) return;
+        if (events & EPOLLERR) { // Reported even with empty interest, would repeat forever
+            int code = 0;
+            socklen_t length = sizeof(code);
+            if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &code, &length) != 0 || code == 0) code = EPIPE;
+            set_error(code, strerror(code));
+            finish();
+            return;
+        }
+        if (!pump(forward_) || !pump(backward_)) {
+            finish();
+            return;
+        }
+        if (forward_.done && backward_.done) {
+            finish();
+            return;
+        }
+        if (events & EPOLLHUP) { // Rest of input is readable without events, writing to it fails in pump
+            uint32_t &interest = fd == first_ ? first_events_ : second_events_;
+            if (interest != Hung) {
+                epoll_.remove(fd);
+                interest = Hung;
+            }
+        }
+        update();
+    }
+
+    bool Relay::pump(Direction &direction) {
+        while (!direction.done) {
+            if (direction.buffered > 0) { // Drain pipe first to keep ordering and free space
+                ssize_t n = splice(direction.pipe[0], nullptr, direction.to, nullptr, direction.buffered,
+                                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (n > 0) {
+                    direction.buffered -= static_cast<size_t>(n);
+                    direction.total += static_cast<uint64_t>(n);
+                    continue;
+                }
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0 && errno == EAGAIN) return true; // Wait for EPOLLOUT of destination
+                set_error();
+                return false;
+            }
+            if (direction.eof) { // Everything delivered: forward half-close
+                if (shutdown(direction.to, SHUT_WR) != 0 && errno != ENOTSOCK && errno != ENOTCONN) {
+                    set_error();
+                    return false;
+                }
+                direction.done = true;
+                return true;
+            }
+            ssize_t n = splice(direction.from, nullptr, direction.pipe[1], nullptr, direction.capacity,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+            if (n > 0) {
+                direction.buffered += static_cast<size_t>(n);
+                continue;
+            }
+            if (n == 0) {
+                direction.eof = true;
+                continue;
+            }
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return true; // Wait for EPOLLIN of source
+            set_error();
+            return false;
+        }
+        return true;
+    }
+
+    void Relay::update() {
+        uint32_t first = 0, second = 0;
+        if (!forward_.done && !forward_.eof && forward_.buffered == 0) first |= EPOLLIN;
+        if (forward_.buffered > 0) second |= EPOLLOUT;
+        if (!backward_.done && !backward_.eof && backward_.buffered == 0) second |= EPOLLIN;
+        if (backward_.buffered > 0) first |= EPOLLOUT;
+        if (first_events_ != Hung && first != first_events_ && epoll_.update(first_, first)) first_events_ = first;
+        if (second_events_ != Hung && second != second_events_ && epoll_.update(second_, second))
+            second_events_ = second;
+    }
+
+    void Relay::finish() {
+        Handler done;
+        done.swap(done_);
+        close(); // Pipes with unsent data after error are not reused
+        if (done) done(*this); // Relay may be destroyed here
+    }
+}
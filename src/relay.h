@@ -0,0 +1,123 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+#ifndef IO_RELAY_H
+#define IO_RELAY_H
+
+#include "io.h"
+#include <functional>
+#include <mutex>
+
+namespace io {
+    struct Epoll;
+
+    /**
+     * Process wide pool of non-blocking pipes used as kernel buffers for splice()
+     */
+    struct PipePool {
+        static PipePool &shared();
+
+        /**
+         * Get pipe (read end, write end) or returns false
+         */
+        bool acquire(int pipe[2]);
+
+        /**
+         * Return pipe. Pipes with data left are closed
+         */
+        void release(int pipe[2], bool empty);
+
+        /**
+         * Capacity of new pipes (F_SETPIPE_SZ), 0 - system default. Only pipes created later are affected
+         */
+        void set_pipe_size(size_t size);
+
+        ~PipePool();
+
+    private:
+        PipePool() { }
+
+        std::mutex lock_;
+        std::vector<std::pair<int, int>> free_;
+        size_t pipe_size_ = 0;
+    };
+
+    /**
+     * Bidirectional zero-copy relay between two descriptors (sockets or pipes) driven by Epoll.
+     * Data moves with splice() through pooled pipes and never enters user space.
+     * EOF in one direction is forwarded as shutdown(SHUT_WR) to other side (half-close),
+     * relay finishes when both directions are done or on error. Relay owns and closes descriptors.
+     * splice() can't suppress SIGPIPE, so first relay sets SIGPIPE to SIG_IGN unless application
+     * installed its own handler (which then must not terminate process).
+     */
+    struct Relay : public WithError {
+        typedef std::shared_ptr<Relay> Ptr;
+
+        /**
+         * Called once when relay is finished. Relay may be destroyed inside
+         */
+        using Handler = std::function<void(Relay &)>;
+
+        Relay(Epoll &epoll, int first, int second, const Handler &done = nullptr);
+
+        static Ptr create(Epoll &epoll, int first, int second, const Handler &done = nullptr);
+
+        /**
+         * Stop relay, close descriptors
+         */
+        ~Relay();
+
+        /**
+         * Stop relay without calling handler and close descriptors
+         */
+        void close();
+
+        inline bool active() const { return active_; }
+
+        /**
+         * Bytes relayed from first to second descriptor
+         */
+        inline uint64_t forwarded() const { return forward_.total; }
+
+        /**
+         * Bytes relayed from second to first descriptor
+         */
+        inline uint64_t backwarded() const { return backward_.total; }
+
+    private:
+        struct Direction {
+            int from = -1, to = -1;
+            int pipe[2] = {-1, -1};
+            size_t buffered = 0;  // Bytes in pipe
+            size_t capacity = 0;
+            bool eof = false;     // Source is read to the end
+            bool done = false;    // All data delivered and destination shut down
+            uint64_t total = 0;
+        };
+
+        Relay(const Relay &) = delete;
+
+        Relay &operator=(const Relay &) = delete;
+
+        void on_event(Epoll &, uint32_t events, int fd);
+
+        bool pump(Direction &direction);
+
+        void update();
+
+        void finish();
+
+        enum : uint32_t {
+            Hung = ~0U // Interest of descriptor removed from Epoll after EPOLLHUP
+        };
+
+        Epoll &epoll_;
+        int first_, second_;
+        Direction forward_, backward_;
+        uint32_t first_events_ = 0, second_events_ = 0;
+        bool active_ = false;
+        Handler done_;
+    };
+}
+#endif //IO_RELAY_H
@@ -0,0 +1,326 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+#include "shm.h"
+#include <algorithm>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace io {
+
+    enum : size_t {
+        HeaderPage = 4096, // Two ring headers
+        HeaderSlot = 1024,
+        HandshakeDescriptors = 5 // Region and four events
+    };
+
+    static_assert(sizeof(ShmRing::Header) <= HeaderSlot, "Ring header doesn't fit in slot");
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2, "Shared atomics must be lock-free");
+
+    /**
+     * Wait for `event` or death of peer. Returns false if peer is gone
+     */
+    static bool wait_event(int event, int peer) {
+        pollfd fds[2] = {{event, POLLIN, 0},
+                         {peer,  POLLRDHUP, 0}};
+        while (poll(fds, peer >= 0 ? 2 : 1, -1) < 0)
+            if (errno != EINTR) return false;
+        if (fds[0].revents & POLLIN) {
+            eventfd_t value;
+            eventfd_read(event, &value);
+            return true;
+        }
+        return (fds[1].revents & (POLLRDHUP | POLLHUP | POLLERR)) == 0;
+    }
+
+    ShmRing::ShmRing(Header *header, char *data, size_t capacity, int data_event, int space_event)
+            : header_(header), data_(data), capacity_(capacity), data_event_(data_event), space_event_(space_event) { }
+
+    size_t ShmRing::readable(char **data) const {
+        uint64_t tail = header_->tail.load(std::memory_order_relaxed);
+        uint64_t head = header_->head.load(std::memory_order_acquire);
+        size_t offset = static_cast<size_t>(tail & (capacity_ - 1));
+        size_t size = static_cast<size_t>(head - tail);
+        *data = data_ + offset;
+        return std::min(size, capacity_ - offset);
+    }
+
+    void ShmRing::consume(size_t size) {
+        if (size == 0) return;
+        header_->tail.fetch_add(size, std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (header_->writer_waiting.load(std::memory_order_relaxed) && header_->writer_waiting.exchange(0))
+            eventfd_write(space_event_, 1);
+    }
+
+    size_t ShmRing::writable(char **data) const {
+        uint64_t head = header_->head.load(std::memory_order_relaxed);
+        uint64_t tail = header_->tail.load(std::memory_order_acquire);
+        size_t offset = static_cast<size_t>(head & (capacity_ - 1));
+        size_t size = capacity_ - static_cast<size_t>(head - tail);
+        *data = data_ + offset;
+        return std::min(size, capacity_ - offset);
+    }
+
+    void ShmRing::commit(size_t size) {
+        if (size == 0) return;
+        header_->head.fetch_add(size, std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (header_->reader_waiting.load(std::memory_order_relaxed) && header_->reader_waiting.exchange(0))
+            eventfd_write(data_event_, 1);
+    }
+
+    bool ShmRing::reader_idle() {
+        header_->reader_waiting.store(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return header_->head.load(std::memory_order_acquire) == header_->tail.load(std::memory_order_relaxed);
+    }
+
+    bool ShmRing::writer_idle() {
+        header_->writer_waiting.store(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return header_->head.load(std::memory_order_relaxed) - header_->tail.load(std::memory_order_acquire) ==
+               capacity_;
+    }
+
+    void ShmRing::close() {
+        header_->closed.store(1, std::memory_order_release);
+        eventfd_write(data_event_, 1);
+    }
+
+    ShmReadBuffer::ShmReadBuffer(ShmRing &ring, int peer_socket) : ring_(ring), peer_(peer_socket) { }
+
+    std::streambuf::int_type ShmReadBuffer::underflow() {
+        if (gptr() < egptr())  // buffer not exhausted
+            return traits_type::to_int_type(*gptr());
+        if (eback() != nullptr) { // Release shared memory of consumed block
+            ring_.consume(static_cast<size_t>(egptr() - eback()));
+            setg(nullptr, nullptr, nullptr);
+        }
+        bool alive = true;
+        while (true) {
+            char *data;
+            size_t size = ring_.readable(&data);
+            if (size > 0) {
+                setg(data, data, data + size);
+                return traits_type::to_int_type(*gptr());
+            }
+            if (ring_.closed() || !alive) { // Writer may commit last bytes just before close
+                if (ring_.readable(&data) > 0) continue;
+                return traits_type::eof();
+            }
+            if (!ring_.reader_idle()) continue; // Data arrived while going idle
+            if (!blocking_) return traits_type::eof();
+            alive = wait_event(ring_.data_event(), peer_);
+        }
+    }
+
+    std::streamsize ShmReadBuffer::showmanyc() {
+        char *data;
+        size_t size = ring_.readable(&data);
+        if (size > 0) return static_cast<std::streamsize>(size);
+        if (!ring_.closed()) return 0;
+        size = ring_.readable(&data); // Committed just before close
+        return size > 0 ? static_cast<std::streamsize>(size) : -1;
+    }
+
+    ShmWriteBuffer::ShmWriteBuffer(ShmRing &ring, int peer_socket) : ring_(ring), peer_(peer_socket) { }
+
+    bool ShmWriteBuffer::publish() {
+        if (pbase() == nullptr) return true;
+        ring_.commit(static_cast<size_t>(pptr() - pbase()));
+        setp(pptr(), epptr()); // Rest of block is still free
+        return true;
+    }
+
+    std::streambuf::int_type ShmWriteBuffer::overflow(std::streambuf::int_type ch) {
+        publish();
+        bool alive = true;
+        while (true) {
+            char *data;
+            size_t size = ring_.writable(&data);
+            if (size > 0) {
+                setp(data, data + size);
+                break;
+            }
+            if (!alive) return traits_type::eof();
+            if (!ring_.writer_idle()) continue; // Space appeared while going idle
+            alive = wait_event(ring_.space_event(), peer_);
+        }
+        if (ch == traits_type::eof()) return traits_type::not_eof(ch);
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+        return ch;
+    }
+
+    int ShmWriteBuffer::sync() {
+        return publish() ? 0 : -1;
+    }
+
+    ShmStream::ShmStream(int region, size_t capacity, const int events[4], int socket, bool server)
+            : input_(nullptr), output_(nullptr) {
+        std::copy(events, events + 4, events_);
+        socket_ = socket;
+        size_ = HeaderPage + 2 * capacity;
+        void *memory = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, region, 0);
+        if (memory == MAP_FAILED) return;
+        memory_ = memory;
+        char *base = static_cast<char *>(memory_);
+        ShmRing::Header *headers[2];
+        for (int i = 0; i < 2; ++i) {
+            void *slot = base + i * HeaderSlot;
+            headers[i] = server ? new(slot) ShmRing::Header() : static_cast<ShmRing::Header *>(slot);
+        }
+        if (server) {
+            for (auto header:headers) {
+                header->head.store(0);
+                header->tail.store(0);
+                header->reader_waiting.store(1); // Reader starts idle
+                header->writer_waiting.store(0);
+                header->closed.store(0);
+            }
+        }
+        ShmRing rings[2] = {ShmRing(headers[0], base + HeaderPage, capacity, events_[0], events_[1]),
+                            ShmRing(headers[1], base + HeaderPage + capacity, capacity, events_[2], events_[3])};
+        in_ = rings[server ? 0 : 1];   // Ring 0: client -> server
+        out_ = rings[server ? 1 : 0];
+        descriptor_ = in_.data_event();
+        input_buffer_.reset(new ShmReadBuffer(in_, socket_));
+        output_buffer_.reset(new ShmWriteBuffer(out_, socket_));
+        input_.rdbuf(input_buffer_.get());
+        output_.rdbuf(output_buffer_.get());
+    }
+
+    ShmStream::~ShmStream() {
+        close();
+    }
+
+    void ShmStream::clear_event() {
+        eventfd_t value;
+        eventfd_read(descriptor_, &value);
+    }
+
+    void ShmStream::close() {
+        if (valid()) {
+            output_.flush();
+            out_.close();
+            munmap(memory_, size_);
+            memory_ = nullptr;
+        }
+        for (auto &event:events_) {
+            if (event >= 0) ::close(event);
+            event = -1;
+        }
+        if (socket_ >= 0) ::close(socket_);
+        socket_ = -1;
+        descriptor_ = -1;
+    }
+
+    ShmStream::Ptr ShmStream::connect(const std::string &path) {
+        int socket = connect_unix(path);
+        if (socket < 0) return nullptr;
+        uint64_t capacity = 0;
+        iovec data = {&capacity, sizeof(capacity)};
+        union {
+            char buffer[CMSG_SPACE(sizeof(int) * HandshakeDescriptors)];
+            cmsghdr align;
+        } control;
+        msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = &data;
+        message.msg_iovlen = 1;
+        message.msg_control = control.buffer;
+        message.msg_controllen = sizeof(control.buffer);
+        ssize_t n;
+        do {
+            n = recvmsg(socket, &message, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+        } while (n < 0 && errno == EINTR);
+        cmsghdr *header = CMSG_FIRSTHDR(&message);
+        if (n != sizeof(capacity) || header == nullptr || header->cmsg_type != SCM_RIGHTS ||
+            header->cmsg_len != CMSG_LEN(sizeof(int) * HandshakeDescriptors)) {
+            ::close(socket);
+            return nullptr;
+        }
+        int fds[HandshakeDescriptors];
+        memcpy(fds, CMSG_DATA(header), sizeof(fds));
+        Ptr stream(new ShmStream(fds[0], static_cast<size_t>(capacity), fds + 1, socket, false));
+        ::close(fds[0]);
+        if (!stream->valid()) return nullptr;
+        return stream;
+    }
+
+    ShmServer::ShmServer(const std::string &path, size_t ring_size, int backlog, uint32_t mode)
+            : listener_(UnixServerManager::create(path, backlog, mode)), ring_size_(4096) {
+        while (ring_size_ < ring_size) ring_size_ <<= 1;
+        descriptor_ = listener_->descriptor();
+        if (!listener_->has_valid_descriptor()) set_error(listener_->error_code(), listener_->error_message());
+    }
+
+    void ShmServer::close() {
+        listener_->close();
+        descriptor_ = -1;
+    }
+
+    ShmStream::Ptr ShmServer::accept() {
+        int socket = listener_->next_descriptor();
+        if (socket < 0) {
+            set_error(listener_->error_code(), listener_->error_message());
+            return nullptr;
+        }
+        int fds[HandshakeDescriptors];
+        fds[0] = memfd_create("io-shm", MFD_CLOEXEC);
+        bool ok = fds[0] >= 0 && ftruncate(fds[0], static_cast<off_t>(HeaderPage + 2 * ring_size_)) == 0;
+        for (size_t i = 1; i < HandshakeDescriptors; ++i) {
+            fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            ok &= fds[i] >= 0;
+        }
+        ShmStream::Ptr stream;
+        if (ok) {
+            stream.reset(new ShmStream(fds[0], ring_size_, fds + 1, socket, true)); // Owns events and socket
+            ok = stream->valid();
+        }
+        if (ok) {
+            uint64_t capacity = ring_size_;
+            iovec data = {&capacity, sizeof(capacity)};
+            union {
+                char buffer[CMSG_SPACE(sizeof(fds))];
+                cmsghdr align;
+            } control;
+            msghdr message;
+            memset(&message, 0, sizeof(message));
+            memset(&control, 0, sizeof(control));
+            message.msg_iov = &data;
+            message.msg_iovlen = 1;
+            message.msg_control = control.buffer;
+            message.msg_controllen = sizeof(control.buffer);
+            cmsghdr *header = CMSG_FIRSTHDR(&message);
+            header->cmsg_level = SOL_SOCKET;
+            header->cmsg_type = SCM_RIGHTS;
+            header->cmsg_len = CMSG_LEN(sizeof(fds));
+            memcpy(CMSG_DATA(header), fds, sizeof(fds));
+            ssize_t n;
+            do {
+                n = sendmsg(socket, &message, MSG_NOSIGNAL);
+            } while (n < 0 && errno == EINTR);
+            ok = n == sizeof(capacity);
+        }
+        if (fds[0] >= 0) ::close(fds[0]);
+        if (!ok) {
+            set_error();
+            if (!stream) {
+                for (size_t i = 1; i < HandshakeDescriptors; ++i) if (fds[i] >= 0) ::close(fds[i]);
+                ::close(socket);
+            }
+            return nullptr;
+        }
+        return stream;
+    }
+
+    std::shared_ptr<ShmServer> ShmServer::create(const std::string &path, size_t ring_size) {
+        return std::make_shared<ShmServer>(path, ring_size);
+    }
+}
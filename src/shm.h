@@ -0,0 +1,206 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+#ifndef IO_SHM_H
+#define IO_SHM_H
+
+#include "io.h"
+#include <atomic>
+
+namespace io {
+
+    /**
+     * Single producer single consumer byte ring in shared memory. Positions grow monotonically,
+     * capacity is power of 2. Peer is woken through eventfd only if it announced that it's idle.
+     */
+    struct ShmRing {
+        struct Header {
+            alignas(64) std::atomic<uint64_t> head;          // Written bytes
+            alignas(64) std::atomic<uint64_t> tail;          // Consumed bytes
+            alignas(64) std::atomic<uint32_t> reader_waiting;
+            std::atomic<uint32_t> writer_waiting;
+            std::atomic<uint32_t> closed;                    // Writer is gone
+        };
+
+        ShmRing() { }
+
+        ShmRing(Header *header, char *data, size_t capacity, int data_event, int space_event);
+
+        /**
+         * Contiguous readable block. Returns its size
+         */
+        size_t readable(char **data) const;
+
+        /**
+         * Release `size` read bytes and wake writer if it waits for space
+         */
+        void consume(size_t size);
+
+        /**
+         * Contiguous free block. Returns its size
+         */
+        size_t writable(char **data) const;
+
+        /**
+         * Publish `size` written bytes and wake reader if it's idle
+         */
+        void commit(size_t size);
+
+        /**
+         * Announce idle reader. Returns false if data arrived meanwhile (don't sleep then)
+         */
+        bool reader_idle();
+
+        /**
+         * Announce blocked writer. Returns false if space appeared meanwhile (don't sleep then)
+         */
+        bool writer_idle();
+
+        inline bool closed() const { return header_->closed.load(std::memory_order_acquire) != 0; }
+
+        void close();
+
+        inline size_t capacity() const { return capacity_; }
+
+        inline int data_event() const { return data_event_; }
+
+        inline int space_event() const { return space_event_; }
+
+    private:
+        Header *header_ = nullptr;
+        char *data_ = nullptr;
+        size_t capacity_ = 0;
+        int data_event_ = -1, space_event_ = -1;
+    };
+
+    /**
+     * Reader over ShmRing without intermediate copies: get area points into shared memory
+     */
+    struct ShmReadBuffer : public std::streambuf {
+        explicit ShmReadBuffer(ShmRing &ring, int peer_socket);
+
+        /**
+         * In blocking mode reading waits for data, otherwise EOF is returned when ring is empty
+         */
+        inline void set_blocking(bool enable) { blocking_ = enable; }
+
+    private:
+        int_type underflow();
+
+        std::streamsize showmanyc();
+
+        ShmRing &ring_;
+        int peer_;
+        bool blocking_ = true;
+    };
+
+    /**
+     * Writer over ShmRing without intermediate copies: put area points into shared memory.
+     * Data is published on flush or when free block is filled. Waits when ring is full
+     */
+    struct ShmWriteBuffer : public std::streambuf {
+        explicit ShmWriteBuffer(ShmRing &ring, int peer_socket);
+
+    private:
+        int_type overflow(int_type ch);
+
+        int sync();
+
+        bool publish();
+
+        ShmRing &ring_;
+        int peer_;
+    };
+
+    /**
+     * Duplex shared memory channel between two processes with FileStream-like interface.
+     * descriptor() is eventfd which becomes readable when data arrives: register it in Epoll,
+     * call clear_event() and read input() in non-blocking mode until EOF.
+     */
+    struct ShmStream : public Storage {
+        typedef std::shared_ptr<ShmStream> Ptr;
+
+        /**
+         * Connect to ShmServerManager at `path`. Returns null on error
+         */
+        static Ptr connect(const std::string &path);
+
+        inline std::istream &input() noexcept { return input_; }
+
+        inline std::ostream &output() noexcept { return output_; }
+
+        /**
+         * Switch input to blocking or non-blocking (for Epoll) mode
+         */
+        inline void set_blocking(bool enable) { if (input_buffer_) input_buffer_->set_blocking(enable); }
+
+        /**
+         * Reset readiness eventfd after notification
+         */
+        void clear_event();
+
+        /**
+         * UNIX socket of handshake. Register it in Epoll with EPOLLRDHUP to learn about died peer
+         */
+        inline int peer_descriptor() const { return socket_; }
+
+        /**
+         * Peer closed its output
+         */
+        bool peer_closed() const { return in_.closed(); }
+
+        /**
+         * Flush output and tell peer about closing
+         */
+        virtual void close() override;
+
+        virtual ~ShmStream();
+
+    private:
+        ShmStream(int region, size_t capacity, const int events[4], int socket, bool server);
+
+        bool valid() const { return memory_ != nullptr && input_buffer_ && output_buffer_; }
+
+        void *memory_ = nullptr;
+        size_t size_ = 0;
+        int events_[4] = {-1, -1, -1, -1}; // Data and space events of client->server and server->client rings
+        int socket_ = -1;
+        ShmRing in_, out_;
+        std::unique_ptr<ShmReadBuffer> input_buffer_;
+        std::unique_ptr<ShmWriteBuffer> output_buffer_;
+        std::istream input_;
+        std::ostream output_;
+
+        friend struct ShmServer;
+    };
+
+    /**
+     * Server of shared memory channels. Clients connect by UNIX socket at `path`, server creates memfd
+     * region with rings and eventfds and passes them with SCM_RIGHTS. UNIX socket is kept to detect
+     * died peers. Channels are not file descriptors, so this is not a ConnectionManager for
+     * AsyncSocketServer: register descriptor() in Epoll and call accept() when it's readable
+     */
+    struct ShmServer : public Storage, public WithError {
+        ShmServer(const std::string &path, size_t ring_size = 1024 * 1024, int backlog = 100, uint32_t mode = 0777);
+
+        /**
+         * Accept client and make channel. Returns null on error
+         */
+        ShmStream::Ptr accept();
+
+        inline const std::string &path() const { return listener_->path(); }
+
+        /**
+         * Close listener. Accepted channels stay open
+         */
+        virtual void close() override;
+
+        static std::shared_ptr<ShmServer> create(const std::string &path, size_t ring_size = 1024 * 1024);
+
+    private:
+        std::shared_ptr<UnixServerManager> listener_;
+        size_t ring_size_;
+    };
+}
+#endif //IO_SHM_H
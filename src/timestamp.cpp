@@ -0,0 +1,96 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+#include "timestamp.h"
+#include <cerrno>
+#include <cstring>
+#include <time.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+
+namespace io {
+
+    bool enable_timestamping(int fd, bool transmit) {
+        int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+        // Only timestamps without packet copies are queued, ID identifies send() call
+        if (transmit) flags |= SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+        return setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0;
+    }
+
+    uint64_t timestamp_now() {
+        timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        return static_cast<uint64_t>(now.tv_sec) * 1000000000ull + static_cast<uint64_t>(now.tv_nsec);
+    }
+
+    /**
+     * Software timestamp from SCM_TIMESTAMPING control message or 0
+     */
+    static uint64_t software_timestamp(msghdr &message) {
+        for (cmsghdr *header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header)) {
+            if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_TIMESTAMPING) continue;
+            scm_timestamping stamps;
+            memcpy(&stamps, CMSG_DATA(header), sizeof(stamps));
+            return static_cast<uint64_t>(stamps.ts[0].tv_sec) * 1000000000ull +
+                   static_cast<uint64_t>(stamps.ts[0].tv_nsec);
+        }
+        return 0;
+    }
+
+    ssize_t receive_timestamped(int fd, void *data, size_t size, int flags, uint64_t *received,
+                                sockaddr_storage *from, socklen_t *from_length) {
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(scm_timestamping)) + 64];
+        iovec vector;
+        vector.iov_base = data;
+        vector.iov_len = size;
+        msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = &vector;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        if (from != nullptr) {
+            message.msg_name = from;
+            message.msg_namelen = sizeof(sockaddr_storage);
+        }
+        ssize_t n;
+        do {
+            n = recvmsg(fd, &message, flags);
+        } while (n < 0 && errno == EINTR);
+        if (received != nullptr) *received = n >= 0 ? software_timestamp(message) : 0;
+        if (from_length != nullptr) *from_length = n >= 0 ? message.msg_namelen : 0;
+        return n;
+    }
+
+    size_t read_transmit_timestamps(int fd, std::vector<TransmitTimestamp> &result) {
+        size_t appended = 0;
+        while (true) {
+            alignas(cmsghdr) char control[512];
+            msghdr message;
+            memset(&message, 0, sizeof(message));
+            message.msg_control = control;
+            message.msg_controllen = sizeof(control);
+            ssize_t n = recvmsg(fd, &message, MSG_ERRQUEUE | MSG_DONTWAIT);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) break; // EAGAIN - queue is empty
+            uint64_t time = software_timestamp(message);
+            const sock_extended_err *error = nullptr;
+            for (cmsghdr *header = CMSG_FIRSTHDR(&message);
+                 header != nullptr; header = CMSG_NXTHDR(&message, header)) {
+                if ((header->cmsg_level == SOL_IP && header->cmsg_type == IP_RECVERR) ||
+                    (header->cmsg_level == SOL_IPV6 && header->cmsg_type == IPV6_RECVERR))
+                    error = reinterpret_cast<const sock_extended_err *>(CMSG_DATA(header));
+            }
+            if (time == 0 || error == nullptr || error->ee_origin != SO_EE_ORIGIN_TIMESTAMPING) continue;
+            TransmitTimestamp stamp;
+            stamp.id = error->ee_data;
+            stamp.kind = error->ee_info;
+            stamp.time = time;
+            result.push_back(stamp);
+            ++appended;
+        }
+        return appended;
+    }
+}
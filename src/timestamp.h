@@ -0,0 +1,56 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+#ifndef IO_TIMESTAMP_H
+#define IO_TIMESTAMP_H
+
+#include <cstdint>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+namespace io {
+
+    /**
+     * Enable kernel software timestamps (SO_TIMESTAMPING) on socket `fd`: arrival time of received data
+     * and, if `transmit` is set, time when sent data left the stack. Works on loopback too.
+     * Returns false on error
+     */
+    bool enable_timestamping(int fd, bool transmit = true);
+
+    /**
+     * Current time of clock used by kernel software timestamps (CLOCK_REALTIME) in nanoseconds
+     */
+    uint64_t timestamp_now();
+
+    /**
+     * recv()/recvfrom() which also returns kernel arrival time of data in `received` (nanoseconds,
+     * see timestamp_now(), 0 if not available). For TCP it is time of last segment which delivered read bytes.
+     * Use MSG_PEEK to get time without consuming data. Returns count of bytes or -1 with errno
+     */
+    ssize_t receive_timestamped(int fd, void *data, size_t size, int flags, uint64_t *received,
+                                sockaddr_storage *from = nullptr, socklen_t *from_length = nullptr);
+
+    /**
+     * Transmit timestamp from socket error queue
+     */
+    struct TransmitTimestamp {
+        enum Kind : uint32_t {
+            Sent = 0,      // Passed to device (SCM_TSTAMP_SND)
+            Scheduled = 1, // Entered packet scheduler (SCM_TSTAMP_SCHED)
+            Acked = 2      // Acknowledged by peer, TCP only (SCM_TSTAMP_ACK)
+        };
+
+        uint32_t id;       // Datagram number for UDP, offset of last byte of send() call for TCP
+        uint32_t kind;
+        uint64_t time;     // Nanoseconds, see timestamp_now()
+    };
+
+    /**
+     * Drain transmit timestamps from error queue of `fd` without blocking and append them to `result`.
+     * Returns count of appended timestamps
+     */
+    size_t read_transmit_timestamps(int fd, std::vector<TransmitTimestamp> &result);
+}
+#endif //IO_TIMESTAMP_H
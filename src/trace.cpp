@@ -0,0 +1,183 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+#include "trace.h"
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+namespace io {
+    namespace trace {
+        std::atomic<bool> enabled_(false);
+
+        thread_local Ring *ring_ = nullptr;
+
+        namespace {
+            std::mutex registry_lock;
+            std::vector<Ring *> rings;
+            size_t ring_size = 65536;
+
+            // Reference point for converting ticks to wall time
+            uint64_t base_ticks = 0;
+            std::chrono::steady_clock::time_point base_time;
+
+            const char *names[] = {"epoll_wait", "callback", "accept", "disconnect", "write_stall"};
+
+            void free_ring(Ring *ring) {
+                delete[] ring->events;
+                delete ring;
+            }
+
+            /**
+             * Marks ring of finished thread. Ring itself is kept until clear() to be dumped
+             */
+            struct ThreadExit {
+                ~ThreadExit() {
+                    std::lock_guard<std::mutex> guard(registry_lock);
+                    if (ring_ != nullptr) ring_->alive = false;
+                    ring_ = nullptr;
+                }
+            };
+
+            thread_local ThreadExit thread_exit;
+
+            /**
+             * Nanoseconds per tick since reference point (`ticks`, `time`). Called without registry_lock:
+             * it may sleep to get enough precision
+             */
+            double tick_period(uint64_t ticks_at, std::chrono::steady_clock::time_point time) {
+#if defined(__x86_64__) || defined(__i386__)
+                auto elapsed = std::chrono::steady_clock::now() - time;
+                if (elapsed < std::chrono::milliseconds(10)) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10) - elapsed);
+                }
+                uint64_t ticks = now() - ticks_at;
+                auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - time).count();
+                return ticks > 0 ? static_cast<double>(ns) / ticks : 1.0;
+#else
+                return 1.0;
+#endif
+            }
+
+            /**
+             * Events of one ring copied for dump
+             */
+            struct Copy {
+                int tid;
+                std::vector<Event> events;
+            };
+        }
+
+        Ring *attach_thread() {
+            (void) thread_exit; // Force construction of TLS destructor
+            Ring *ring = new Ring;
+            {
+                std::lock_guard<std::mutex> guard(registry_lock);
+                size_t size = 1;
+                while (size < ring_size) size <<= 1;
+                ring->events = new Event[size]();
+                ring->mask = size - 1;
+                rings.push_back(ring);
+            }
+            ring->head.store(0, std::memory_order_relaxed);
+            ring->tail.store(0, std::memory_order_relaxed);
+            ring->tid = static_cast<int>(syscall(SYS_gettid));
+            ring->alive = true;
+            ring_ = ring;
+            return ring;
+        }
+
+        void enable(bool enable) {
+            std::lock_guard<std::mutex> guard(registry_lock);
+            if (enable && base_ticks == 0) {
+                base_time = std::chrono::steady_clock::now();
+                base_ticks = now();
+            }
+            enabled_.store(enable, std::memory_order_relaxed);
+        }
+
+        void set_ring_size(size_t events) {
+            std::lock_guard<std::mutex> guard(registry_lock);
+            ring_size = events > 0 ? events : 1;
+        }
+
+        bool dump(std::ostream &out) {
+            std::vector<Copy> copies;
+            uint64_t ticks_at;
+            std::chrono::steady_clock::time_point time;
+            { // Only copying under lock: recording threads attach and exit meanwhile
+                std::lock_guard<std::mutex> guard(registry_lock);
+                ticks_at = base_ticks;
+                time = base_time;
+                for (Ring *ring:rings) {
+                    uint64_t head = ring->head.load(std::memory_order_acquire);
+                    uint64_t size = ring->mask + 1;
+                    uint64_t from = head > size ? head - size : 0;
+                    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+                    if (from < tail) from = tail;
+                    copies.push_back(Copy{ring->tid, std::vector<Event>()});
+                    copies.back().events.reserve(static_cast<size_t>(head - from));
+                    for (uint64_t i = from; i < head; ++i) copies.back().events.push_back(ring->events[i & ring->mask]);
+                }
+            }
+            double period = tick_period(ticks_at, time);
+            int pid = getpid();
+            char line[256];
+            bool first = true;
+            out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+            for (auto &copy:copies) {
+                for (const Event &event:copy.events) {
+                    if (event.start < ticks_at || event.type > WriteStall) continue;
+                    double ts = (event.start - ticks_at) * period / 1000.0;
+                    double duration = (event.end - event.start) * period / 1000.0;
+                    const char *arg_name = event.type == PollWait ? "ready" :
+                                           event.type == WriteStall ? "bytes" : "events";
+                    if (event.start == event.end) {
+                        snprintf(line, sizeof(line),
+                                 "%s{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d,"
+                                         "\"args\":{\"fd\":%d}}",
+                                 first ? "" : ",", names[event.type], ts, pid, copy.tid, event.fd);
+                    } else {
+                        snprintf(line, sizeof(line),
+                                 "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+                                         "\"args\":{\"fd\":%d,\"%s\":%llu}}",
+                                 first ? "" : ",", names[event.type], ts, duration, pid, copy.tid, event.fd,
+                                 arg_name, static_cast<unsigned long long>(event.arg));
+                    }
+                    out << line;
+                    first = false;
+                }
+            }
+            out << "]}\n";
+            out.flush();
+            return out.good();
+        }
+
+        bool dump(const std::string &path) {
+            std::ofstream file(path, std::ios::out | std::ios::trunc);
+            if (!file) return false;
+            return dump(file);
+        }
+
+        void clear() {
+            std::lock_guard<std::mutex> guard(registry_lock);
+            std::vector<Ring *> alive;
+            for (Ring *ring:rings) {
+                if (ring->alive) {
+                    ring->tail.store(ring->head.load(std::memory_order_acquire), std::memory_order_relaxed);
+                    alive.push_back(ring);
+                } else {
+                    free_ring(ring);
+                }
+            }
+            rings.swap(alive);
+        }
+    }
+}
@@ -0,0 +1,164 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+#ifndef IO_TRACE_H
+#define IO_TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <iosfwd>
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <x86intrin.h>
+
+#else
+#include <time.h>
+#endif
+
+namespace io {
+    /**
+     * Low overhead event tracing. Every thread writes fixed size records to its own ring buffer,
+     * so recording is a couple of stores without locks. Buffers can be dumped at any moment
+     * to Chrome/Perfetto trace-event JSON (chrome://tracing, ui.perfetto.dev).
+     * Tracing is disabled by default.
+     */
+    namespace trace {
+
+        enum Type : uint16_t {
+            PollWait = 0,   // Epoll::poll blocked in epoll_wait. Argument - count of ready events
+            Callback = 1,   // Epoll callback dispatch. Argument - events mask
+            Accept = 2,     // New client accepted
+            Disconnect = 3, // Client disconnected
+            WriteStall = 4, // FileWriteBuffer::sync flushed data. Argument - bytes written
+        };
+
+        /**
+         * Single trace record (32 bytes)
+         */
+        struct Event {
+            uint64_t start;
+            uint64_t end;
+            uint64_t arg;
+            int32_t fd;
+            uint16_t type;
+            uint16_t reserved;
+        };
+
+        /**
+         * Per-thread ring buffer. Oldest records are overwritten
+         */
+        struct Ring {
+            Event *events;
+            uint64_t mask;
+            std::atomic<uint64_t> head;
+            std::atomic<uint64_t> tail;
+            int tid;
+            bool alive;
+        };
+
+        extern std::atomic<bool> enabled_;
+
+        extern thread_local Ring *ring_;
+
+        /**
+         * Allocate and register ring buffer for current thread
+         */
+        Ring *attach_thread();
+
+        /**
+         * Is tracing enabled
+         */
+        inline bool enabled() { return enabled_.load(std::memory_order_relaxed); }
+
+        /**
+         * Enable or disable recording for all threads
+         */
+        void enable(bool enable = true);
+
+        /**
+         * Set ring size (in events, rounded up to power of two) for threads started tracing after this call.
+         * Default is 65536 events (2 MB) per thread
+         */
+        void set_ring_size(size_t events);
+
+        /**
+         * Current timestamp in raw clock ticks
+         */
+        inline uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+            return __rdtsc();
+#else
+            timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+#endif
+        }
+
+        /**
+         * Append record to current thread ring buffer
+         */
+        inline void record(Type type, int fd, uint64_t start, uint64_t end, uint64_t arg = 0) {
+            Ring *ring = ring_;
+            if (ring == nullptr) ring = attach_thread();
+            uint64_t head = ring->head.load(std::memory_order_relaxed);
+            Event &event = ring->events[head & ring->mask];
+            event.start = start;
+            event.end = end;
+            event.arg = arg;
+            event.fd = fd;
+            event.type = type;
+            ring->head.store(head + 1, std::memory_order_release);
+        }
+
+        /**
+         * Record event without duration
+         */
+        inline void instant(Type type, int fd, uint64_t arg = 0) {
+            if (!enabled()) return;
+            uint64_t ts = now();
+            record(type, fd, ts, ts, arg);
+        }
+
+        /**
+         * Record duration of scope if tracing was enabled at construction
+         */
+        struct Span {
+            inline Span(Type type, int fd, uint64_t arg = 0) : start_(enabled() ? now() : 0), arg_(arg), fd_(fd),
+                                                               type_(type) { }
+
+            inline void set_arg(uint64_t arg) { arg_ = arg; }
+
+            inline ~Span() { if (start_ != 0) record(type_, fd_, start_, now(), arg_); }
+
+        private:
+            Span(const Span &) = delete;
+
+            Span &operator=(const Span &) = delete;
+
+            uint64_t start_, arg_;
+            int fd_;
+            Type type_;
+        };
+
+        /**
+         * Write all recorded events of all threads as Chrome trace-event JSON.
+         * Not async-signal-safe: call it from regular context, for example from a signal handler
+         * delivered through Application::attach.
+         */
+        bool dump(std::ostream &out);
+
+        /**
+         * Write all recorded events to file. Returns false on IO error
+         */
+        bool dump(const std::string &path);
+
+        /**
+         * Drop recorded events and release buffers of finished threads
+         */
+        void clear();
+    }
+}
+#endif //IO_TRACE_H
@@ -0,0 +1,434 @@
+//
+// Created by Red Dec on 19.10.26.
+//
+
+/**
+ * io-loadgen: load generator for line based servers (AsyncSocketServer, Publisher).
+ * Modes:
+ * - echo: send request lines and wait for same count of response lines (request/response)
+ * - firehose: send lines without reading responses
+ * - sink: only read lines pushed by server (Publisher subscribers)
+ * With fixed rate (-r) requests are sent by schedule (open loop) and latency is measured from scheduled
+ * send time, so stalls of server or client are not hidden by delayed sending (coordinated omission).
+ * Requests without response shortly after end of run are recorded with latency until then and fail the run.
+ */
+
+#include "async.h"
+#include "histogram.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace {
+
+    enum class Mode {
+        Echo, Firehose, Sink
+    };
+
+    struct Config {
+        std::string host, port, path;
+        Mode mode = Mode::Echo;
+        size_t connections = 1, threads = 1, depth = 1, size = 64;
+        double rate = 0;         // Total requests per second, 0 - closed loop
+        double duration = 10;    // Seconds
+        double report = 1;       // Seconds between progress lines, 0 - disabled
+    };
+
+    struct Counters {
+        std::atomic<uint64_t> sent{0}, received{0}, sent_bytes{0}, received_bytes{0}, errors{0}, late{0}, unsent{0},
+                unanswered{0};
+    };
+
+    const uint64_t MinTickNs = 10000;          // Open loop timer doesn't fire more often
+    const size_t MaxQueued = 16 * 1024 * 1024; // Unsent bytes per connection before new slots are deferred
+    const uint64_t DrainNs = 1000000000ULL;    // Wait for responses after end of run before counting them lost
+
+    uint64_t monotonic_ns() {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return static_cast<uint64_t>(now.tv_sec) * 1000000000ULL + static_cast<uint64_t>(now.tv_nsec);
+    }
+
+    struct Connection {
+        int fd = -1;
+        std::string out;
+        size_t out_offset = 0;
+        std::deque<uint64_t> inflight; // Send time of requests waiting for response
+        std::deque<uint64_t> deferred; // Scheduled time of slots waiting for space in queue
+        uint64_t next_send = 0;
+        bool want_write = false;
+    };
+
+    /**
+     * Single reactor thread driving its share of connections
+     */
+    struct Worker {
+        Worker(const Config &config, Counters &counters, io::LatencyHistogram &latency, size_t first,
+               size_t count) : config_(config), counters_(counters), latency_(latency), first_(first),
+                               connections_(count), request_(config.size > 0 ? config.size - 1 : 0, 'x') {
+            request_ += '\n';
+            if (config_.rate > 0) interval_ = static_cast<uint64_t>(1e9 * config_.connections / config_.rate);
+        }
+
+        bool connect() {
+            io::SocketOptions options;
+            options.no_delay = true;
+            for (auto &connection:connections_) {
+                connection.fd = config_.path.empty() ? io::connect_tcp(config_.host, config_.port)
+                                                     : io::connect_unix(config_.path);
+                if (connection.fd < 0) {
+                    fprintf(stderr, "connect: %s\n", strerror(errno));
+                    return false;
+                }
+                io::apply_socket_options(connection.fd, options);
+                fcntl(connection.fd, F_SETFL, fcntl(connection.fd, F_GETFL) | O_NONBLOCK);
+            }
+            return true;
+        }
+
+        void run(uint64_t start, uint64_t stop) {
+            for (size_t i = 0; i < connections_.size(); ++i) {
+                auto &connection = connections_[i];
+                epoll_.add(connection.fd, EPOLLIN | EPOLLRDHUP, [this, i](io::Epoll &, uint32_t events, int) {
+                    on_socket(i, events);
+                });
+                // Spread schedules of all connections over one interval
+                connection.next_send = start + interval_ * (first_ + i) / config_.connections;
+                if (config_.mode == Mode::Sink) continue;
+                if (interval_ == 0 && config_.mode == Mode::Echo) {
+                    for (size_t n = 0; n < config_.depth; ++n) enqueue(connection, monotonic_ns());
+                    flush(connection);
+                } else if (interval_ == 0) {
+                    set_write(connection, true); // Firehose: refill whenever socket is writable
+                }
+            }
+            if (interval_ > 0 && config_.mode != Mode::Sink) {
+                timer_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+                epoll_.add(timer_, EPOLLIN, [this](io::Epoll &, uint32_t, int fd) {
+                    uint64_t expirations;
+                    if (read(fd, &expirations, sizeof(expirations)) < 0) return;
+                    on_tick();
+                });
+                arm(start);
+            }
+            while (monotonic_ns() < stop) epoll_.poll(10);
+            if (timer_ >= 0) {
+                epoll_.remove(timer_);
+                close(timer_);
+                timer_ = -1;
+            }
+            draining_ = true; // No new requests, collect responses to sent ones
+            while (config_.mode == Mode::Echo && awaiting() && monotonic_ns() < stop + DrainNs) epoll_.poll(10);
+            for (auto &connection:connections_) disconnect(connection);
+        }
+
+    private:
+        void on_tick() {
+            uint64_t now = monotonic_ns();
+            for (auto &connection:connections_) {
+                if (connection.fd < 0) continue;
+                while (connection.next_send <= now) { // Catch up: every missed slot is still sent
+                    if (!connection.deferred.empty() || connection.out.size() - connection.out_offset > MaxQueued) {
+                        connection.deferred.push_back(connection.next_send); // Latency still counts from schedule
+                        counters_.late.fetch_add(1, std::memory_order_relaxed);
+                    } else enqueue(connection, connection.next_send);
+                    connection.next_send += interval_;
+                }
+                flush(connection);
+            }
+            uint64_t next = UINT64_MAX;
+            for (auto &connection:connections_)
+                if (connection.fd >= 0 && connection.next_send < next) next = connection.next_send;
+            if (next != UINT64_MAX) arm(std::max(next, now + MinTickNs));
+        }
+
+        /**
+         * Fire timer at absolute monotonic time: sending is not delayed by timer resolution
+         */
+        void arm(uint64_t deadline) {
+            itimerspec spec;
+            memset(&spec, 0, sizeof(spec));
+            spec.it_value.tv_sec = static_cast<time_t>(deadline / 1000000000ULL);
+            spec.it_value.tv_nsec = static_cast<long>(deadline % 1000000000ULL);
+            timerfd_settime(timer_, TFD_TIMER_ABSTIME, &spec, nullptr);
+        }
+
+        void enqueue(Connection &connection, uint64_t scheduled) {
+            connection.out += request_;
+            if (config_.mode == Mode::Echo) connection.inflight.push_back(scheduled);
+            counters_.sent.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void flush(Connection &connection) {
+            while (true) {
+                while (connection.fd >= 0 && connection.out_offset < connection.out.size()) {
+                    ssize_t n = send(connection.fd, connection.out.data() + connection.out_offset,
+                                     connection.out.size() - connection.out_offset, MSG_NOSIGNAL | MSG_DONTWAIT);
+                    if (n < 0 && errno == EINTR) continue;
+                    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                        set_write(connection, true);
+                        return;
+                    }
+                    if (n < 0) {
+                        counters_.errors.fetch_add(1, std::memory_order_relaxed);
+                        disconnect(connection);
+                        return;
+                    }
+                    connection.out_offset += static_cast<size_t>(n);
+                    counters_.sent_bytes.fetch_add(static_cast<uint64_t>(n), std::memory_order_relaxed);
+                }
+                connection.out.clear();
+                connection.out_offset = 0;
+                if (connection.deferred.empty()) break;
+                // Queue drained: send late slots in order of schedule
+                while (!connection.deferred.empty() && connection.out.size() <= MaxQueued) {
+                    enqueue(connection, connection.deferred.front());
+                    connection.deferred.pop_front();
+                }
+            }
+            if (!(config_.mode == Mode::Firehose && interval_ == 0)) set_write(connection, false);
+        }
+
+        void set_write(Connection &connection, bool enable) {
+            if (connection.fd < 0 || connection.want_write == enable) return;
+            connection.want_write = enable;
+            epoll_.update(connection.fd, EPOLLIN | EPOLLRDHUP | (enable ? EPOLLOUT : 0));
+        }
+
+        void on_socket(size_t index, uint32_t events) {
+            auto &connection = connections_[index];
+            if (connection.fd < 0) return;
+            if (events & EPOLLIN) receive(connection);
+            if (connection.fd >= 0 && (events & EPOLLOUT)) {
+                if (config_.mode == Mode::Firehose && interval_ == 0 && connection.out.empty()) {
+                    for (size_t n = 0; n < 256 || connection.out.size() < 65536; ++n) enqueue(connection, 0);
+                }
+                flush(connection);
+            }
+            if (connection.fd >= 0 && (events & (EPOLLERR | EPOLLHUP))) {
+                counters_.errors.fetch_add(1, std::memory_order_relaxed);
+                disconnect(connection);
+            }
+        }
+
+        void receive(Connection &connection) {
+            char buffer[65536];
+            for (int reads = 0; reads < 16; ++reads) {
+                ssize_t n = recv(connection.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+                if (n <= 0) {
+                    if (n < 0) counters_.errors.fetch_add(1, std::memory_order_relaxed);
+                    disconnect(connection);
+                    return;
+                }
+                counters_.received_bytes.fetch_add(static_cast<uint64_t>(n), std::memory_order_relaxed);
+                uint64_t now = monotonic_ns(), lines = 0;
+                for (const char *ptr = buffer, *end = buffer + n;
+                     (ptr = static_cast<const char *>(memchr(ptr, '\n', static_cast<size_t>(end - ptr)))) != nullptr;
+                     ++ptr) {
+                    ++lines;
+                    if (config_.mode != Mode::Echo || connection.inflight.empty()) continue;
+                    latency_.record(now - connection.inflight.front());
+                    connection.inflight.pop_front();
+                    if (interval_ == 0 && !draining_) enqueue(connection, now); // Closed loop: next request on response
+                }
+                counters_.received.fetch_add(lines, std::memory_order_relaxed);
+                if (n < static_cast<ssize_t>(sizeof(buffer))) break;
+            }
+            if (config_.mode == Mode::Echo && interval_ == 0) flush(connection);
+        }
+
+        bool awaiting() const {
+            for (auto &connection:connections_)
+                if (connection.fd >= 0 && (!connection.inflight.empty() || !connection.deferred.empty())) return true;
+            return false;
+        }
+
+        void disconnect(Connection &connection) {
+            if (connection.fd < 0) return;
+            uint64_t now = monotonic_ns();
+            for (uint64_t scheduled:connection.deferred) { // Never sent: waited at least until now
+                if (config_.mode == Mode::Echo) latency_.record(now - scheduled);
+                counters_.unsent.fetch_add(1, std::memory_order_relaxed);
+            }
+            connection.deferred.clear();
+            for (uint64_t scheduled:connection.inflight) { // Sent but never answered: waited at least until now
+                latency_.record(now - scheduled);
+                counters_.unanswered.fetch_add(1, std::memory_order_relaxed);
+            }
+            connection.inflight.clear();
+            epoll_.remove(connection.fd);
+            close(connection.fd);
+            connection.fd = -1;
+        }
+
+        const Config &config_;
+        Counters &counters_;
+        io::LatencyHistogram &latency_;
+        size_t first_;
+        std::vector<Connection> connections_;
+        std::string request_;
+        uint64_t interval_ = 0; // Between requests of one connection in open loop
+        int timer_ = -1;
+        bool draining_ = false; // Run is over, waiting for responses
+        io::Epoll epoll_;
+    };
+
+    void usage(const char *name) {
+        fprintf(stderr,
+                "io-loadgen %s: load generator for line based servers\n"
+                "Usage: %s (-a host:port | -u path) [options]\n"
+                "  -a host:port  TCP server ([::1]:port for IPv6)\n"
+                "  -u path       UNIX socket server\n"
+                "  -m mode       echo (request/response, default), firehose (send only), sink (receive only)\n"
+                "  -c count      concurrent connections (default 1)\n"
+                "  -t threads    reactor threads (default 1)\n"
+                "  -r rate       total requests per second by schedule (open loop), 0 - closed loop (default)\n"
+                "  -p depth      outstanding requests per connection in closed loop echo (default 1)\n"
+                "  -s size       request line size with \\n in bytes (default 64)\n"
+                "  -d seconds    duration (default 10)\n"
+                "  -i seconds    progress report interval, 0 - disabled (default 1)\n",
+                io::version().c_str(), name);
+    }
+
+    bool parse_address(const std::string &address, Config &config) {
+        size_t colon = address.rfind(':');
+        if (colon == std::string::npos || colon + 1 == address.size()) return false;
+        config.host = address.substr(0, colon);
+        config.port = address.substr(colon + 1);
+        if (config.host.size() >= 2 && config.host.front() == '[' && config.host.back() == ']')
+            config.host = config.host.substr(1, config.host.size() - 2);
+        if (config.host.empty()) config.host = "localhost";
+        return true;
+    }
+}
+
+int main(int argc, char **argv) {
+    Config config;
+    int option;
+    while ((option = getopt(argc, argv, "a:u:m:c:t:r:p:s:d:i:h")) != -1) {
+        switch (option) {
+            case 'a':
+                if (!parse_address(optarg, config)) {
+                    fprintf(stderr, "invalid address %s\n", optarg);
+                    return 2;
+                }
+                break;
+            case 'u':
+                config.path = optarg;
+                break;
+            case 'm':
+                if (strcmp(optarg, "echo") == 0) config.mode = Mode::Echo;
+                else if (strcmp(optarg, "firehose") == 0) config.mode = Mode::Firehose;
+                else if (strcmp(optarg, "sink") == 0) config.mode = Mode::Sink;
+                else {
+                    fprintf(stderr, "unknown mode %s\n", optarg);
+                    return 2;
+                }
+                break;
+            case 'c':
+                config.connections = strtoul(optarg, nullptr, 10);
+                break;
+            case 't':
+                config.threads = strtoul(optarg, nullptr, 10);
+                break;
+            case 'r':
+                config.rate = strtod(optarg, nullptr);
+                break;
+            case 'p':
+                config.depth = strtoul(optarg, nullptr, 10);
+                break;
+            case 's':
+                config.size = strtoul(optarg, nullptr, 10);
+                break;
+            case 'd':
+                config.duration = strtod(optarg, nullptr);
+                break;
+            case 'i':
+                config.report = strtod(optarg, nullptr);
+                break;
+            default:
+                usage(argv[0]);
+                return option == 'h' ? 0 : 2;
+        }
+    }
+    if ((config.port.empty() && config.path.empty()) || config.connections == 0 || config.threads == 0 ||
+        config.depth == 0 || config.size == 0 || config.duration <= 0 || config.rate < 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (config.threads > config.connections) config.threads = config.connections;
+    signal(SIGPIPE, SIG_IGN);
+
+    Counters counters;
+    io::LatencyHistogram latency;
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (size_t i = 0, first = 0; i < config.threads; ++i) {
+        size_t count = config.connections / config.threads + (i < config.connections % config.threads ? 1 : 0);
+        workers.emplace_back(new Worker(config, counters, latency, first, count));
+        if (!workers.back()->connect()) return 1;
+        first += count;
+    }
+
+    uint64_t start = monotonic_ns();
+    uint64_t stop = start + static_cast<uint64_t>(config.duration * 1e9);
+    std::vector<std::thread> threads;
+    for (auto &worker:workers) threads.emplace_back([&worker, start, stop]() { worker->run(start, stop); });
+
+    uint64_t last_sent = 0, last_received = 0, last_bytes = 0, last_at = start;
+    if (config.report > 0) {
+        uint64_t period = static_cast<uint64_t>(config.report * 1e9);
+        for (uint64_t next = start + period; next < stop; next += period) {
+            uint64_t now = monotonic_ns();
+            if (next > now) usleep(static_cast<useconds_t>((next - now) / 1000));
+            now = monotonic_ns();
+            double seconds = (now - last_at) / 1e9;
+            uint64_t sent = counters.sent.load(), received = counters.received.load();
+            uint64_t bytes = counters.sent_bytes.load() + counters.received_bytes.load();
+            printf("%6.1fs sent %10.0f/s received %10.0f/s %8.2f MB/s p99 %.1fus\n", (now - start) / 1e9,
+                   (sent - last_sent) / seconds, (received - last_received) / seconds,
+                   (bytes - last_bytes) / seconds / 1e6, latency.percentile(99) / 1000.0);
+            fflush(stdout);
+            last_sent = sent;
+            last_received = received;
+            last_bytes = bytes;
+            last_at = now;
+        }
+    }
+    for (auto &thread:threads) thread.join();
+
+    double seconds = (monotonic_ns() - start) / 1e9;
+    printf("connections %zu threads %zu duration %.2fs\n", config.connections, config.threads, seconds);
+    printf("sent %llu (%.0f/s, %.2f MB/s) received %llu (%.0f/s, %.2f MB/s)\n",
+           static_cast<unsigned long long>(counters.sent.load()), counters.sent.load() / seconds,
+           counters.sent_bytes.load() / seconds / 1e6,
+           static_cast<unsigned long long>(counters.received.load()), counters.received.load() / seconds,
+           counters.received_bytes.load() / seconds / 1e6);
+    if (counters.errors.load() > 0 || counters.late.load() > 0)
+        printf("errors %llu late %llu (sent after send queue drained, latency counted from schedule)\n",
+               static_cast<unsigned long long>(counters.errors.load()),
+               static_cast<unsigned long long>(counters.late.load()));
+    if (counters.unsent.load() > 0)
+        printf("schedule broken: %llu requests never sent, recorded with latency until end of run\n",
+               static_cast<unsigned long long>(counters.unsent.load()));
+    if (counters.unanswered.load() > 0)
+        printf("unanswered: %llu requests got no response within %.1fs after end of run, recorded with latency "
+               "until end of run\n", static_cast<unsigned long long>(counters.unanswered.load()), DrainNs / 1e9);
+    if (config.mode == Mode::Echo) printf("latency %s\n", latency.summary().c_str());
+    return counters.errors.load() > 0 || counters.unsent.load() > 0 || counters.unanswered.load() > 0 ? 1 : 0;
+}